@@ -0,0 +1,204 @@
+#pragma once
+// The benchmark scenarios that `main --bench` (and `make bench`, which runs it for every kernel) times, and the
+// statistics and reports of their results.
+//
+// Every scenario is computed `trials` times after a warm up, and only the computation of the iterations is timed. The
+// reports have the median and 95th percentile of those times, and the median absolute deviation as a measure of the
+// noise between runs.
+//
+// The results can also be compared with a baseline, the CSV of an earlier run (see compare_with_baseline), to catch a
+// change that makes one of the scenarios slower.
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// A view to time: the point in the middle of the image, and how many world units there are across it
+struct BenchScenario {
+    const char* name;
+    int which_set;
+    double centre_x, centre_y;
+    double across;
+    int max_iters;
+};
+
+static const BenchScenario BENCH_SCENARIOS[] = {
+    // what the window starts with, at the iterations of the old table in the README
+    {"start", 0, 0, 0, 4, 1024},
+    // seahorse valley, full of boundary with pixels inside the set next to ones that escape at every count
+    {"boundary", 0, -0.75, 0.1, 0.08, 1024},
+    // inside the main cardioid, every pixel runs to the maximum
+    {"interior", 0, -0.2, 0, 0.5, 1024},
+    // a deep zoom with many more iterations, where a few pixels near the boundary run far longer than their neighbours
+    {"high_iters", 0, -0.743643887, 0.131825904, 0.00002, 8192},
+    {"julia", 1, 0, 0, 4, 1024},
+};
+
+struct BenchResult {
+    std::string kernel;
+    int threads;
+    std::string scenario;
+    int width, height;
+    int max_iters;
+    // how long every trial took
+    std::vector<double> seconds;
+    // the sum of the iteration counts of the image
+    long long iterations;
+
+    // The time that p percent of the trials were at most, interpolating between trials
+    double percentile(double p) const {
+        std::vector<double> sorted = seconds;
+        std::sort(sorted.begin(), sorted.end());
+        const double at = p / 100 * (sorted.size() - 1);
+        const size_t below = (size_t)at;
+        if (below + 1 >= sorted.size())
+            return sorted.back();
+        return sorted[below] + (at - below) * (sorted[below + 1] - sorted[below]);
+    }
+
+    double median() const {
+        return percentile(50);
+    }
+
+    // The median of how far the trials are from the median
+    double mad() const {
+        BenchResult deviations = *this;
+        const double m = median();
+        for (double& s : deviations.seconds)
+            s = std::abs(s - m);
+        return deviations.median();
+    }
+
+    double mpixels_per_second() const {
+        return (double)width * height / 1e6 / median();
+    }
+
+    double iterations_per_second() const {
+        return iterations / median();
+    }
+};
+
+static void print_bench_table(const std::vector<BenchResult>& results) {
+    printf("%-8s %7s %-11s %10s %10s %10s %10s %12s\n", "kernel", "threads", "scenario", "median ms", "p95 ms", "mad ms",
+           "Mpixel/s", "Giter/s");
+    for (const BenchResult& r : results) {
+        printf("%-8s %7d %-11s %10.2f %10.2f %10.2f %10.2f %12.3f\n", r.kernel.c_str(), r.threads, r.scenario.c_str(),
+               r.median() * 1e3, r.percentile(95) * 1e3, r.mad() * 1e3, r.mpixels_per_second(), r.iterations_per_second() / 1e9);
+    }
+}
+
+#define BENCH_CSV_HEADER "kernel,threads,scenario,width,height,max_iters,trials,median_s,p95_s,mad_s,mpixels_per_s,iterations_per_s"
+
+// Writes a row per result with BENCH_CSV_HEADER's columns. Returns whether it worked.
+static bool write_bench_csv(const std::string& path, const std::vector<BenchResult>& results) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file)
+        return false;
+    bool ok = fprintf(file, "%s\n", BENCH_CSV_HEADER) > 0;
+    for (const BenchResult& r : results) {
+        ok = ok && fprintf(file, "%s,%d,%s,%d,%d,%d,%d,%.9g,%.9g,%.9g,%.9g,%.9g\n", r.kernel.c_str(), r.threads,
+                           r.scenario.c_str(), r.width, r.height, r.max_iters, (int)r.seconds.size(), r.median(),
+                           r.percentile(95), r.mad(), r.mpixels_per_second(), r.iterations_per_second()) > 0;
+    }
+    return fclose(file) == 0 && ok;
+}
+
+// Writes the results as a JSON array of objects, with the time of every trial as well as the statistics
+static bool write_bench_json(const std::string& path, const std::vector<BenchResult>& results) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file)
+        return false;
+    bool ok = fprintf(file, "[\n") > 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        ok = ok && fprintf(file, "  {\"kernel\": \"%s\", \"threads\": %d, \"scenario\": \"%s\", \"width\": %d, \"height\": %d, "
+                           "\"max_iters\": %d, \"median_s\": %.9g, \"p95_s\": %.9g, \"mad_s\": %.9g, \"mpixels_per_s\": %.9g, "
+                           "\"iterations_per_s\": %.9g, \"seconds\": [", r.kernel.c_str(), r.threads, r.scenario.c_str(),
+                           r.width, r.height, r.max_iters, r.median(), r.percentile(95), r.mad(), r.mpixels_per_second(),
+                           r.iterations_per_second()) > 0;
+        for (size_t t = 0; t < r.seconds.size(); ++t)
+            ok = ok && fprintf(file, "%s%.9g", t ? ", " : "", r.seconds[t]) > 0;
+        ok = ok && fprintf(file, "]}%s\n", i + 1 < results.size() ? "," : "") > 0;
+    }
+    ok = ok && fprintf(file, "]\n") > 0;
+    return fclose(file) == 0 && ok;
+}
+
+// A row of a results CSV, as far as comparing with it goes
+struct BenchBaseline {
+    std::string kernel;
+    int threads;
+    std::string scenario;
+    int width, height;
+    int max_iters;
+    double median, mad;
+};
+
+// Reads a CSV written by write_bench_csv (or several of them glued together, like make bench does). Returns whether it
+// was one.
+static bool read_bench_csv(const std::string& path, std::vector<BenchBaseline>& rows) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file)
+        return false;
+    char line[1024];
+    bool ok = fgets(line, sizeof(line), file) && strncmp(line, BENCH_CSV_HEADER, strlen(BENCH_CSV_HEADER)) == 0;
+    while (ok && fgets(line, sizeof(line), file)) {
+        std::vector<std::string> fields;
+        for (char* field = strtok(line, ",\r\n"); field; field = strtok(nullptr, ",\r\n"))
+            fields.push_back(field);
+        if (fields.empty())
+            continue;
+        // kernel, threads, scenario, width, height, max_iters, trials, median_s, p95_s, mad_s, ...
+        if (fields.size() < 10) {
+            ok = false;
+            break;
+        }
+        rows.push_back({fields[0], atoi(fields[1].c_str()), fields[2], atoi(fields[3].c_str()), atoi(fields[4].c_str()),
+                        atoi(fields[5].c_str()), atof(fields[7].c_str()), atof(fields[9].c_str())});
+    }
+    fclose(file);
+    return ok;
+}
+
+// Compares the median time of every result with the one of the same kernel, threads, scenario, size and iterations in
+// the baseline, prints a line for each and returns how many got slower.
+//
+// A result is slower when its median is more than `tolerance` (e.g. 0.05 for 5%) above the baseline's, and the
+// difference is also more than `noise_factor` times the noise of the two. The noise is worked out from the median
+// absolute deviations, which are about 2/3 of a standard deviation for normally distributed times, so a single slow
+// trial doesn't move it much. More trials make both the medians and the noise more reliable.
+static int compare_with_baseline(const std::vector<BenchResult>& results, const std::vector<BenchBaseline>& baseline,
+                                 double tolerance, double noise_factor = 3) {
+    int regressions = 0;
+    printf("\n%-8s %7s %-11s %12s %12s %8s %10s  %s\n", "kernel", "threads", "scenario", "baseline ms", "median ms",
+           "change", "noise ms", "result");
+    for (const BenchResult& r : results) {
+        const BenchBaseline* base = nullptr;
+        for (const BenchBaseline& b : baseline) {
+            if (b.kernel == r.kernel && b.threads == r.threads && b.scenario == r.scenario && b.width == r.width &&
+                b.height == r.height && b.max_iters == r.max_iters)
+                base = &b;
+        }
+        if (!base) {
+            printf("%-8s %7d %-11s %12s %12.2f %8s %10s  no baseline\n", r.kernel.c_str(), r.threads, r.scenario.c_str(),
+                   "-", r.median() * 1e3, "-", "-");
+            continue;
+        }
+        const double difference = r.median() - base->median;
+        const double noise = 1.4826 * std::sqrt(base->mad * base->mad + r.mad() * r.mad());
+        const bool slower = difference > tolerance * base->median && difference > noise_factor * noise;
+        const bool faster = -difference > tolerance * base->median && -difference > noise_factor * noise;
+        regressions += slower;
+        printf("%-8s %7d %-11s %12.2f %12.2f %+7.1f%% %10.2f  %s\n", r.kernel.c_str(), r.threads, r.scenario.c_str(),
+               base->median * 1e3, r.median() * 1e3, 100 * difference / base->median, noise * 1e3,
+               slower ? "SLOWER" : faster ? "faster" : "ok");
+    }
+    if (regressions)
+        printf("%d of %d scenarios got slower than the baseline\n", regressions, (int)results.size());
+    else
+        printf("No scenario got slower than the baseline\n");
+    return regressions;
+}
@@ -1,3 +1,4 @@
+#pragma once
 struct Complex
 {
 	double real, imaginary;
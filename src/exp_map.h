@@ -0,0 +1,177 @@
+#pragma once
+// The exponential map of a zoom: the plane around the point being zoomed into, sampled in angle and log(radius)
+// instead of x and y. Every frame of a zoom towards that point is then a resampling of the same strip, zooming in is
+// moving down it, and the strip only has about as many samples for every doubling of the zoom as a single frame.
+//
+// Sample (u, v) is at angle 2pi * u / width and radius outer_radius * exp(-v * 2pi / width), so that samples are as far
+// apart along a row as along a column. Rows are computed CHUNK_ROWS at a time when a frame first needs them, and the
+// ones the frames have moved past can be dropped, so long zooms don't need the whole strip in memory.
+//
+// The frames all have the centre of the zoom in their middle, so a pixel is at the same angle and the same distance in
+// pixels from it in every frame. Which column of the strip it samples and how far up from the frame's row for a
+// pixel's distance of 1 it is, are worked out once, and sampling a frame is then just a lookup for every pixel.
+//
+// Close to the centre the strip has far more samples than the frames have pixels, so it stops at the largest circle
+// that the last frame (the one zoomed in the furthest) covers. That frame is computed like any other image instead,
+// and the pixels of every frame inside the circle are sampled from it.
+#ifdef USE_OMP
+    #include <omp.h>
+#endif
+#include <cmath>
+#include <map>
+#include <vector>
+#include "kernels.h"
+
+struct ExpMap {
+    static const int CHUNK_ROWS = 64;
+
+    double centre_x, centre_y;
+    double outer_radius;
+    // the distance between the pixels of the last frame, and the radius and row where the strip ends
+    double inner_pixel, inner_radius;
+    int last_row;
+    int width;
+    int max_iters, which_set;
+    // the rows from chunk * CHUNK_ROWS on, one after the other
+    std::map<int, std::vector<int>> chunks;
+    long long rows_computed = 0;
+    // the size of the frames, and for every pixel of them, the column it samples and how many rows closer to the
+    // centre it is than a pixel at distance 1
+    int frame_width, frame_height;
+    std::vector<int> pixel_column;
+    std::vector<float> pixel_rows;
+    // the iterations of the last frame, computed when a frame first needs them
+    std::vector<int> last_frame;
+
+    ExpMap(double _centre_x, double _centre_y, double _outer_radius, double _inner_pixel, int _width, int _max_iters,
+           int _which_set, int _frame_width, int _frame_height)
+        : centre_x(_centre_x), centre_y(_centre_y), outer_radius(_outer_radius), inner_pixel(_inner_pixel),
+          inner_radius(std::min(_frame_width, _frame_height) / 2.0 * _inner_pixel), width(_width), max_iters(_max_iters),
+          which_set(_which_set), frame_width(_frame_width), frame_height(_frame_height),
+          pixel_column((size_t)_frame_width * _frame_height), pixel_rows((size_t)_frame_width * _frame_height) {
+        last_row = std::max(0, (int)std::ceil(row_at(inner_radius)));
+        for (int y = 0; y < frame_height; ++y) {
+            for (int x = 0; x < frame_width; ++x) {
+                const double dx = x - frame_width / 2.0, dy = y - frame_height / 2.0;
+                double u = std::atan2(dy, dx) / row_step();
+                if (u < 0)
+                    u += width;
+                // the pixel in the middle of the frame samples the row half a pixel out, like its neighbours nearly do
+                const double distance = std::max(std::sqrt(dx * dx + dy * dy), 0.5);
+                pixel_column[(size_t)y * frame_width + x] = (int)std::lround(u) % width;
+                pixel_rows[(size_t)y * frame_width + x] = (float)(std::log(distance) / row_step());
+            }
+        }
+    }
+
+    // The distance in log(radius) between two rows
+    double row_step() const {
+        return 2 * M_PI / width;
+    }
+
+    // The row that is at this radius, which can be a fraction
+    double row_at(double radius) const {
+        return std::log(outer_radius / radius) / row_step();
+    }
+
+    // Makes sure that the rows from first to last are there, and drops the chunks outside of them
+    void keep_rows(int first, int last) {
+        const int first_chunk = std::max(0, first) / CHUNK_ROWS, last_chunk = std::max(0, last) / CHUNK_ROWS;
+        for (auto it = chunks.begin(); it != chunks.end();) {
+            if (it->first < first_chunk || it->first > last_chunk)
+                it = chunks.erase(it);
+            else
+                ++it;
+        }
+        for (int chunk = first_chunk; chunk <= last_chunk; ++chunk) {
+            if (!chunks.count(chunk))
+                compute_chunk(chunk);
+        }
+    }
+
+    // The iterations of every pixel of the frame whose pixels are `pixel` world units apart, from the nearest sample
+    // of the strip, or of the last frame for the pixels closer to the centre than inner_radius
+    void sample_frame(double pixel, int* out) {
+        const double frame_row = row_at(pixel), inner_row = row_at(inner_radius);
+        const int first = std::min(last_row, std::max(0, (int)std::floor(frame_row - max_pixel_rows())));
+        const int last = std::min(last_row, (int)std::ceil(frame_row - std::log(0.5) / row_step()));
+        keep_rows(first, last);
+        std::vector<const int*> rows(last - first + 1);
+        for (int v = first; v <= last; ++v)
+            rows[v - first] = &chunks.at(v / CHUNK_ROWS)[(size_t)(v % CHUNK_ROWS) * width];
+        // the middle pixel is the furthest in
+        if (frame_row - std::log(0.5) / row_step() > inner_row && last_frame.empty())
+            compute_last_frame();
+        // how many pixels of the last frame one of this frame is
+        const double ratio = pixel / inner_pixel;
+        const int count = frame_width * frame_height;
+#ifdef USE_OMP
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < count; ++i) {
+            const double row = frame_row - pixel_rows[i];
+            if (row <= inner_row) {
+                const int v = std::max(first, std::min(last, (int)std::lround(row)));
+                out[i] = rows[v - first][pixel_column[i]];
+                continue;
+            }
+            const int x = (int)std::lround((i % frame_width - frame_width / 2.0) * ratio + frame_width / 2.0);
+            const int y = (int)std::lround((i / frame_width - frame_height / 2.0) * ratio + frame_height / 2.0);
+            out[i] = last_frame[(size_t)std::max(0, std::min(frame_height - 1, y)) * frame_width + std::max(0, std::min(frame_width - 1, x))];
+        }
+    }
+
+    // How many points were iterated, for the strip and the last frame together
+    long long points_computed() const {
+        return rows_computed * width + (long long)last_frame.size();
+    }
+
+private:
+    // how many rows in from the one for a pixel's distance of 1 the corners of the frame are
+    float max_pixel_rows() const {
+        return (float)(std::log(std::sqrt((double)frame_width * frame_width + (double)frame_height * frame_height) / 2) / row_step());
+    }
+
+    void compute_last_frame() {
+        last_frame.resize((size_t)frame_width * frame_height);
+#ifdef USE_OMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int y = 0; y < frame_height; ++y) {
+            std::vector<double> xs(frame_width), ys(frame_width, centre_y + (y - frame_height / 2.0) * inner_pixel);
+            for (int x = 0; x < frame_width; ++x)
+                xs[x] = centre_x + (x - frame_width / 2.0) * inner_pixel;
+            iterate_points(xs.data(), ys.data(), frame_width, max_iters, which_set, &last_frame[(size_t)y * frame_width]);
+        }
+    }
+
+    // Computes the rows of the chunk up to last_row
+    void compute_chunk(int chunk) {
+        std::vector<int>& rows = chunks[chunk];
+        rows.resize((size_t)CHUNK_ROWS * width);
+        const int rows_left = last_row + 1 - chunk * CHUNK_ROWS;
+        const int row_count = rows_left < CHUNK_ROWS ? rows_left : CHUNK_ROWS;
+        std::vector<double> cos_u(width), sin_u(width);
+        for (int u = 0; u < width; ++u) {
+            cos_u[u] = std::cos(u * row_step());
+            sin_u[u] = std::sin(u * row_step());
+        }
+#ifdef USE_OMP
+#pragma omp parallel for schedule(dynamic) collapse(2)
+#endif
+        for (int j = 0; j < row_count; ++j) {
+            // a row is split into pieces, since a chunk has fewer rows than some machines have threads
+            for (int piece = 0; piece < 16; ++piece) {
+                const double radius = outer_radius * std::exp(-(chunk * CHUNK_ROWS + j) * row_step());
+                const int u0 = (int)((long long)width * piece / 16), u1 = (int)((long long)width * (piece + 1) / 16);
+                std::vector<double> xs(u1 - u0), ys(u1 - u0);
+                for (int u = u0; u < u1; ++u) {
+                    xs[u - u0] = centre_x + radius * cos_u[u];
+                    ys[u - u0] = centre_y + radius * sin_u[u];
+                }
+                iterate_points(xs.data(), ys.data(), u1 - u0, max_iters, which_set, &rows[(size_t)j * width + u0]);
+            }
+        }
+        rows_computed += row_count;
+    }
+};
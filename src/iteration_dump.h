@@ -0,0 +1,147 @@
+#pragma once
+// A file with the iteration counts of a render, so that it can be recoloured or looked at by other tools without
+// computing it again.
+//
+//   header | width * height int32 iteration counts, row by row
+//
+// Everything is little endian, and the counts start at header_size, so the header can grow in later versions. The
+// reader memory maps the file and hands out pointers into it, so even a 100 megapixel dump is ready immediately.
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// What computed the iterations
+#define DUMP_KERNEL_SCALAR 0
+#define DUMP_KERNEL_AVX 1
+#define DUMP_KERNEL_CUDA 2
+
+struct DumpHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t width, height;
+    int32_t max_iters;
+    int32_t which_set;
+    // DUMP_KERNEL_*
+    uint32_t kernel;
+    // how many bits the floating point numbers the kernel iterated with have
+    uint32_t precision;
+    // none are defined yet, so always 0
+    uint32_t flags;
+    uint32_t unused;
+    // pixel (x, y) is at world position offset + (x, y) / scale
+    double offset_x, offset_y;
+    double scale_x, scale_y;
+
+    DumpHeader() {
+        memset(this, 0, sizeof(*this));
+        memcpy(magic, "MBITERS1", 8);
+        version = 1;
+        header_size = sizeof(DumpHeader);
+    }
+
+    size_t pixels() const {
+        return (size_t)width * height;
+    }
+
+    size_t file_size() const {
+        return header_size + pixels() * sizeof(int32_t);
+    }
+};
+
+// Writes a dump a few rows at a time, straight from the buffer they were computed in
+struct IterationDumpWriter {
+    FILE* file;
+    DumpHeader header;
+    size_t rows_written = 0;
+    bool ok;
+
+    IterationDumpWriter(const char* path, const DumpHeader& _header) : header(_header) {
+        file = fopen(path, "wb");
+        ok = file && fwrite(&header, sizeof(header), 1, file) == 1;
+    }
+
+    IterationDumpWriter(const IterationDumpWriter&) = delete;
+    IterationDumpWriter& operator=(const IterationDumpWriter&) = delete;
+
+    ~IterationDumpWriter() {
+        if (file)
+            fclose(file);
+    }
+
+    // Adds the next rows, where row j starts at iterations + j * stride
+    void write_rows(const int* iterations, int rows, int stride) {
+        for (int j = 0; j < rows; ++j)
+            ok = ok && fwrite(iterations + (size_t)j * stride, sizeof(int32_t), header.width, file) == header.width;
+        rows_written += rows;
+    }
+
+    // Returns whether the whole dump made it to the file
+    bool close() {
+        ok = ok && rows_written == header.height;
+        ok = file && fclose(file) == 0 && ok;
+        file = nullptr;
+        return ok;
+    }
+};
+
+// A dump on disk, memory mapped. Check is_open() after opening it.
+struct IterationDump {
+    int fd = -1;
+    size_t file_size = 0;
+    const char* file = nullptr;
+
+    explicit IterationDump(const char* path) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            perror(path);
+            return;
+        }
+        struct stat st;
+        DumpHeader expected;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DumpHeader)) {
+            fprintf(stderr, "%s is not an iteration dump\n", path);
+            return;
+        }
+        file_size = st.st_size;
+        void* mapped = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            perror(path);
+            return;
+        }
+        file = (const char*)mapped;
+        if (memcmp(header().magic, expected.magic, 8) != 0 || header().version != expected.version ||
+            header().header_size < sizeof(DumpHeader) || header().flags != 0 || header().file_size() != file_size) {
+            fprintf(stderr, "%s is not an iteration dump, or it is cut short\n", path);
+            munmap((void*)file, file_size);
+            file = nullptr;
+        }
+    }
+
+    IterationDump(const IterationDump&) = delete;
+    IterationDump& operator=(const IterationDump&) = delete;
+
+    ~IterationDump() {
+        if (file)
+            munmap((void*)file, file_size);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool is_open() const {
+        return file != nullptr;
+    }
+
+    const DumpHeader& header() const {
+        return *(const DumpHeader*)file;
+    }
+
+    // The width * height counts, row by row
+    const int32_t* iterations() const {
+        return (const int32_t*)(file + header().header_size);
+    }
+};
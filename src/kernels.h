@@ -0,0 +1,330 @@
+#pragma once
+// The CPU kernels that count iterations. They all work on a rectangular block of pixels, so that the caller can
+// split a frame up however it likes (tiles, rows, ...) and stop in between blocks.
+#ifdef USE_AVX
+    #include <immintrin.h>
+#endif
+#include <cmath>
+#include <cstdint>
+#include "complex.h"
+
+// The constant used for the julia set
+#define JULIA_CR -0.8
+#define JULIA_CI 0.156
+
+// The distance estimate is only accurate once |z| is well past 2, so its kernels keep going until |z|^2 gets to this
+#define DISTANCE_ESCAPE_NORM 1e6
+
+// A block of pixels in world space. Pixel (i, j) of the block is at world position (x0 + i * dx, y0 + j * dy).
+struct Block {
+    double x0, y0;
+    double dx, dy;
+    int width, height;
+};
+
+inline int get_iters(Complex z, Complex c, int max_iters) {
+    int iters = 0;
+    for (; iters < max_iters; ++iters) {
+        z = z.square() + c;
+        if (z.norm_sq() >= 4) break;
+    }
+    return iters;
+}
+
+// The iterations at a single world position
+inline int get_iters_at(double x, double y, int max_iters, int which_set) {
+    if (which_set == 0)
+        return get_iters({0, 0}, {x, y}, max_iters);
+    return get_iters({x, y}, {JULIA_CR, JULIA_CI}, max_iters);
+}
+
+// Writes the iterations of every pixel in the block to out, where row j starts at out + j * stride
+inline void iterate_block_scalar(const Block& block, int max_iters, int which_set, int* out, int stride) {
+    for (int j = 0; j < block.height; ++j) {
+        double y = block.y0 + j * block.dy;
+        for (int i = 0; i < block.width; ++i) {
+            out[j * stride + i] = get_iters_at(block.x0 + i * block.dx, y, max_iters, which_set);
+        }
+    }
+}
+
+// Same as iterate_block_scalar, but instead of the iterations it writes their colour from table (which has top + 1
+// entries) to out
+inline void colour_block_scalar(const Block& block, int max_iters, int which_set, const uint32_t* table, int top, uint32_t* out, int stride) {
+    for (int j = 0; j < block.height; ++j) {
+        double y = block.y0 + j * block.dy;
+        for (int i = 0; i < block.width; ++i) {
+            int n = get_iters_at(block.x0 + i * block.dx, y, max_iters, which_set);
+            out[j * stride + i] = table[n < top ? n : top];
+        }
+    }
+}
+
+// An estimate of the distance from world position (x, y) to the set, or 0 if it doesn't escape. Along with z, this
+// keeps track of its derivative dz: dz/dc for the Mandelbrot set (starting at 0, and 2 z dz + 1 every iteration) and
+// dz/dz0 for the Julia set (starting at 1, and 2 z dz every iteration). Once z escapes, the distance is
+// |z| log|z| / |dz|, which is accurate even for filaments much thinner than a pixel.
+inline float get_distance_at(double x, double y, int max_iters, int which_set) {
+    const bool mandelbrot = which_set == 0;
+    Complex z = mandelbrot ? Complex{0, 0} : Complex{x, y};
+    const Complex c = mandelbrot ? Complex{x, y} : Complex{JULIA_CR, JULIA_CI};
+    Complex dz = {mandelbrot ? 0.0 : 1.0, 0};
+    const Complex step = {mandelbrot ? 1.0 : 0.0, 0};
+    for (int iters = 0; iters < max_iters; ++iters) {
+        dz = Complex{2 * z.real, 2 * z.imaginary} * dz + step;
+        z = z.square() + c;
+        const double norm = z.norm_sq();
+        if (norm >= DISTANCE_ESCAPE_NORM) {
+            const double r = std::sqrt(norm);
+            return (float)(r * std::log(r) / std::sqrt(dz.norm_sq()));
+        }
+    }
+    return 0;
+}
+
+// Writes the distance estimate of every pixel in the block to out, where row j starts at out + j * stride
+inline void distance_block_scalar(const Block& block, int max_iters, int which_set, float* out, int stride) {
+    for (int j = 0; j < block.height; ++j) {
+        double y = block.y0 + j * block.dy;
+        for (int i = 0; i < block.width; ++i) {
+            out[j * stride + i] = get_distance_at(block.x0 + i * block.dx, y, max_iters, which_set);
+        }
+    }
+}
+
+#ifdef USE_AVX
+// The iterations of the 4 pixels at (x, y), as 64 bit counts.
+// Some of this was taken from https://github.com/OneLoneCoder/olcPixelGameEngine/blob/master/Videos/OneLoneCoder_PGE_Mandelbrot.cpp
+inline __m256i iterate_avx(__m256d x, __m256d y, int max_iters, int which_set) {
+    // Some variables
+    __m256d zr, zi, cr, ci, temp_zr, temp_zi;
+    __m256d zr2, zi2, norm;
+    __m256d _mask1;
+    __m256i _c, _n, _mask2;
+
+    // set 4 and 2
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256i _one = _mm256_set1_epi64x(1);
+    // How many iterations are there?
+    const __m256i _iterations = _mm256_set1_epi64x(max_iters);
+
+    if (which_set == 0) {
+        // c = x + yi
+        cr = x;
+        ci = y;
+        zr = _mm256_setzero_pd();
+        zi = _mm256_setzero_pd();
+    } else {
+        cr = _mm256_set1_pd(JULIA_CR);
+        ci = _mm256_set1_pd(JULIA_CI);
+        zr = x;
+        zi = y;
+    }
+    // the iteration count.
+    _n = _mm256_setzero_si256();
+    do {
+        // get zr^2
+        zr2 = _mm256_mul_pd(zr, zr);
+        // get zi^2
+        zi2 = _mm256_mul_pd(zi, zi);
+
+        // new_zr = (zr^2 - zi^2) + cr
+        // new_zi = 2 * (zr * zi) + ci
+        temp_zr = _mm256_add_pd(_mm256_sub_pd(zr2, zi2), cr);
+        temp_zi = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(zr, zi), two), ci);
+
+        // update
+        zr = temp_zr;
+        zi = temp_zi;
+        // get the norm
+        norm = _mm256_add_pd(zr2, zi2);
+
+        // a lane keeps going while its norm is < 4 and it has iterations left
+        _mask1 = _mm256_cmp_pd(norm, four, _CMP_LT_OQ);
+        _mask2 = _mm256_cmpgt_epi64(_iterations, _n);
+        // cast to integer
+        _mask2 = _mm256_and_si256(_mask2, _mm256_castpd_si256(_mask1));
+        _c = _mm256_and_si256(_one, _mask2);  // Zero out ones where n < iterations
+        _n = _mm256_add_epi64(_n, _c);        // n++ Increase all n
+    } while (_mm256_movemask_pd(_mm256_castsi256_pd(_mask2)) > 0);
+    return _n;
+}
+
+// Same as iterate_block_scalar, but 4 pixels at a time using AVX2. Every time 4 pixels are done, it calls
+// store(row, column, iterations, lanes), where lanes is how many of the 4 are actually in the block.
+template <typename Store>
+inline void iterate_block_avx(const Block& block, int max_iters, int which_set, const Store& store) {
+    // lane k is k pixels to the right of the first one
+    const __m256d zero_one_two_three = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+    const __m256d _xscale = _mm256_set1_pd(block.dx);
+    const __m256d _x0 = _mm256_set1_pd(block.x0);
+
+    for (int j = 0; j < block.height; ++j) {
+        __m256d y = _mm256_set1_pd(block.y0 + j * block.dy);
+        for (int i = 0; i < block.width; i += 4) {
+            // x = ([0, 1, 2, 3] + i) * scale + offset
+            __m256d x = _mm256_add_pd(_mm256_mul_pd(_mm256_add_pd(zero_one_two_three, _mm256_set1_pd(i)), _xscale), _x0);
+            // The last vector of a row might stick out of the block.
+            store(j, i, iterate_avx(x, y, max_iters, which_set), block.width - i < 4 ? block.width - i : 4);
+        }
+    }
+}
+
+// get_distance_at for the 4 pixels at (x, y). A lane stops changing z and dz once it has escaped, and the distances
+// are worked out from those at the end.
+inline void distance_avx(__m256d x, __m256d y, int max_iters, int which_set, float distances[4]) {
+    const bool mandelbrot = which_set == 0;
+    __m256d zr, zi, cr, ci;
+    if (mandelbrot) {
+        cr = x;
+        ci = y;
+        zr = _mm256_setzero_pd();
+        zi = _mm256_setzero_pd();
+    } else {
+        cr = _mm256_set1_pd(JULIA_CR);
+        ci = _mm256_set1_pd(JULIA_CI);
+        zr = x;
+        zi = y;
+    }
+    __m256d dzr = _mm256_set1_pd(mandelbrot ? 0.0 : 1.0);
+    __m256d dzi = _mm256_setzero_pd();
+    const __m256d step = _mm256_set1_pd(mandelbrot ? 1.0 : 0.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d escape = _mm256_set1_pd(DISTANCE_ESCAPE_NORM);
+    // all ones for the lanes that haven't escaped yet
+    __m256d active = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    __m256d escaped_ever = _mm256_setzero_pd();
+    for (int iters = 0; iters < max_iters; ++iters) {
+        // dz = 2 z dz + step
+        __m256d new_dzr = _mm256_add_pd(_mm256_mul_pd(two, _mm256_sub_pd(_mm256_mul_pd(zr, dzr), _mm256_mul_pd(zi, dzi))), step);
+        __m256d new_dzi = _mm256_mul_pd(two, _mm256_add_pd(_mm256_mul_pd(zr, dzi), _mm256_mul_pd(zi, dzr)));
+        // z = z^2 + c
+        __m256d new_zr = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(zr, zr), _mm256_mul_pd(zi, zi)), cr);
+        __m256d new_zi = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(zr, zi), two), ci);
+        zr = _mm256_blendv_pd(zr, new_zr, active);
+        zi = _mm256_blendv_pd(zi, new_zi, active);
+        dzr = _mm256_blendv_pd(dzr, new_dzr, active);
+        dzi = _mm256_blendv_pd(dzi, new_dzi, active);
+        __m256d norm = _mm256_add_pd(_mm256_mul_pd(zr, zr), _mm256_mul_pd(zi, zi));
+        __m256d escaped = _mm256_and_pd(active, _mm256_cmp_pd(norm, escape, _CMP_GE_OQ));
+        escaped_ever = _mm256_or_pd(escaped_ever, escaped);
+        active = _mm256_andnot_pd(escaped, active);
+        if (_mm256_movemask_pd(active) == 0)
+            break;
+    }
+    alignas(32) double r2[4], dz2[4];
+    _mm256_store_pd(r2, _mm256_add_pd(_mm256_mul_pd(zr, zr), _mm256_mul_pd(zi, zi)));
+    _mm256_store_pd(dz2, _mm256_add_pd(_mm256_mul_pd(dzr, dzr), _mm256_mul_pd(dzi, dzi)));
+    const int mask = _mm256_movemask_pd(escaped_ever);
+    for (int lane = 0; lane < 4; ++lane) {
+        const double r = std::sqrt(r2[lane]);
+        distances[lane] = mask & (1 << lane) ? (float)(r * std::log(r) / std::sqrt(dz2[lane])) : 0.0f;
+    }
+}
+
+inline void distance_block_avx(const Block& block, int max_iters, int which_set, float* out, int stride) {
+    const __m256d zero_one_two_three = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+    const __m256d _xscale = _mm256_set1_pd(block.dx);
+    const __m256d _x0 = _mm256_set1_pd(block.x0);
+    float distances[4];
+    for (int j = 0; j < block.height; ++j) {
+        __m256d y = _mm256_set1_pd(block.y0 + j * block.dy);
+        float* row = out + j * stride;
+        for (int i = 0; i < block.width; i += 4) {
+            __m256d x = _mm256_add_pd(_mm256_mul_pd(_mm256_add_pd(zero_one_two_three, _mm256_set1_pd(i)), _xscale), _x0);
+            distance_avx(x, y, max_iters, which_set, distances);
+            for (int k = 0; k < 4 && i + k < block.width; ++k)
+                row[i + k] = distances[k];
+        }
+    }
+}
+
+// Writes the iteration counts to out, where row j starts at out + j * stride
+struct StoreIterations {
+    int* out;
+    int stride;
+
+    void operator()(int j, int i, __m256i _n, int lanes) const {
+        int* row = out + j * stride;
+        for (int k = 0; k < lanes; ++k)
+            row[i + k] = int(_n[k]);
+    }
+};
+
+// Looks the colour of the iteration counts up in table (which has top + 1 entries) and writes it to out. Full vectors
+// are written with streaming stores, since we are not going to read the pixels again before they are uploaded.
+struct StoreColours {
+    const uint32_t* table;
+    int top;
+    uint32_t* out;
+    int stride;
+
+    void operator()(int j, int i, __m256i _n, int lanes) const {
+        uint32_t* pixel = out + j * stride + i;
+        // the counts are 64 bit, put their bottom halves next to each other
+        __m128i _n32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_n, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6)));
+        _n32 = _mm_min_epi32(_n32, _mm_set1_epi32(top));
+        __m128i _colours = _mm_i32gather_epi32((const int*)table, _n32, 4);
+        if (lanes == 4 && ((uintptr_t)pixel & 15) == 0) {
+            _mm_stream_si128((__m128i*)pixel, _colours);
+        } else {
+            alignas(16) uint32_t colours[4];
+            _mm_store_si128((__m128i*)colours, _colours);
+            for (int k = 0; k < lanes; ++k)
+                pixel[k] = colours[k];
+        }
+    }
+};
+
+inline void iterate_block_avx(const Block& block, int max_iters, int which_set, int* out, int stride) {
+    iterate_block_avx(block, max_iters, which_set, StoreIterations{out, stride});
+}
+
+inline void colour_block_avx(const Block& block, int max_iters, int which_set, const uint32_t* table, int top, uint32_t* out, int stride) {
+    iterate_block_avx(block, max_iters, which_set, StoreColours{table, top, out, stride});
+    // make the streaming stores visible to whoever uploads the pixels
+    _mm_sfence();
+}
+#endif
+
+// The iterations at count arbitrary world positions (xs[k], ys[k]), for samples that aren't on a grid
+inline void iterate_points(const double* xs, const double* ys, int count, int max_iters, int which_set, int* out) {
+    int k = 0;
+#ifdef USE_AVX
+    for (; k + 4 <= count; k += 4) {
+        __m256i _n = iterate_avx(_mm256_loadu_pd(xs + k), _mm256_loadu_pd(ys + k), max_iters, which_set);
+        for (int lane = 0; lane < 4; ++lane)
+            out[k + lane] = int(_n[lane]);
+    }
+#endif
+    for (; k < count; ++k)
+        out[k] = get_iters_at(xs[k], ys[k], max_iters, which_set);
+}
+
+// Runs the fastest kernel this was compiled with
+inline void iterate_block(const Block& block, int max_iters, int which_set, int* out, int stride) {
+#ifdef USE_AVX
+    iterate_block_avx(block, max_iters, which_set, out, stride);
+#else
+    iterate_block_scalar(block, max_iters, which_set, out, stride);
+#endif
+}
+
+// The distance estimate of every pixel in the block, with the fastest kernel this was compiled with
+inline void distance_block(const Block& block, int max_iters, int which_set, float* out, int stride) {
+#ifdef USE_AVX
+    distance_block_avx(block, max_iters, which_set, out, stride);
+#else
+    distance_block_scalar(block, max_iters, which_set, out, stride);
+#endif
+}
+
+// Computes the iterations and writes their colours straight to out, without an iteration count buffer in between
+inline void colour_block(const Block& block, int max_iters, int which_set, const uint32_t* table, int top, uint32_t* out, int stride) {
+#ifdef USE_AVX
+    colour_block_avx(block, max_iters, which_set, table, top, out, stride);
+#else
+    colour_block_scalar(block, max_iters, which_set, table, top, out, stride);
+#endif
+}
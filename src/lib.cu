@@ -10,14 +10,16 @@ __device__ void get_world_coords(int screenx, int screeny, double& worldx, doubl
 
 
 // This does the julia iteration count
-__global__ void get_julia_iters(int* iteration_count, int _WIDTH, int _HEIGHT, int MAX_ITERS, double scalex, double scaley, double offsetx, double offsety)
+__global__ void get_julia_iters(int* iteration_count, int _WIDTH, int _HEIGHT, int MAX_ITERS, double scalex, double scaley, double offsetx, double offsety, int y0)
 {
 
-    // get the current thread's x and y values
+    // get the current thread's x and y values. y0 is the first row of the band of rows we were launched for.
     int tx = threadIdx.x + blockDim.x * blockIdx.x;
-    int ty = threadIdx.y + blockDim.y * blockIdx.y;
+    int ty = y0 + threadIdx.y + blockDim.y * blockIdx.y;
 
 
+    if (tx >= _WIDTH || ty >= _HEIGHT) return;
+
     // transform into world coords
     double za, zb;
     get_world_coords(tx, ty, za, zb, scalex, scaley, offsetx, offsety);
@@ -37,10 +39,12 @@ __global__ void get_julia_iters(int* iteration_count, int _WIDTH, int _HEIGHT, i
 }
 
 // see comments above for julia
-__global__ void get_mandelbrot_iters(int* iteration_count, int _WIDTH, int _HEIGHT, int MAX_ITERS, double scalex, double scaley, double offsetx, double offsety)
+__global__ void get_mandelbrot_iters(int* iteration_count, int _WIDTH, int _HEIGHT, int MAX_ITERS, double scalex, double scaley, double offsetx, double offsety, int y0)
 {
     int tx = threadIdx.x + blockDim.x * blockIdx.x;
-    int ty = threadIdx.y + blockDim.y * blockIdx.y;
+    int ty = y0 + threadIdx.y + blockDim.y * blockIdx.y;
+
+    if (tx >= _WIDTH || ty >= _HEIGHT) return;
 
     double ca, cb;
     get_world_coords(tx, ty, ca, cb, scalex, scaley, offsetx, offsety);
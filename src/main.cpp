@@ -1,19 +1,46 @@
+// The size of the window is WIDTH * 2 x HEIGHT * 2, and by default every computed pixel is 2x2 pixels on screen
 #define WIDTH  1600
 #define HEIGHT 1600
+#define DEFAULT_PIXEL_SIZE 2
+// update_vec works in square tiles of this many pixels
+#define TILE_SIZE 64
+// and checks for cancellation every this many rows of a tile
+#define CANCEL_CHECK_ROWS 4
+// How many tiles around the screen get computed ahead of time when nothing else is happening
+#define PREFETCH_MARGIN 2
+// How many iterations per second the colours move by when cycling the palette
+#define PALETTE_CYCLE_SPEED 20
+// Pixels whose iterations differ from a neighbour's by more than this are on an edge, and get anti-aliased
+#define ANTIALIAS_THRESHOLD 2
+// Animation frames with fewer tiles than this for every thread are rendered several at a time, a frame per thread
+#define SMALL_FRAME_TILES 16
 int MAX_ITERS = 128;
 int WHICH_SET = 0;
 int COLOURSCHEME = 0;
-#ifdef USE_AVX
-    #include <immintrin.h>
-#endif
 #include <omp.h>
 #include <SFML/Graphics.hpp>
 #include <SFML/System.hpp>
 #include <SFML/Window.hpp>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
-#include "complex.h"
+#include <thread>
+#include "bench.h"
+#include "exp_map.h"
+#include "iteration_dump.h"
+#include "kernels.h"
+#include "palette.h"
+#include "png.h"
+#include "stage_stats.h"
+#include "tiles.h"
+#include "tile_store.h"
+#include "trace.h"
+#include "y4m.h"
 #ifdef USE_CUDA
 
 void check(cudaError_t code, int line)
@@ -30,50 +57,92 @@ void check(cudaError_t code, int line)
 #include "cuda.h"
 #endif
 
-int current_microseconds() {
-    std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
-    auto duration = now.time_since_epoch();
-    return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() * 1000;
-}
-
-struct Timer {
-    int start;
-    int end;
-    std::string name;
-#ifdef DEBUG
-    Timer(std::string _name) : name(_name), start(current_microseconds()) {}
-    ~Timer() {
-        end = current_microseconds();
-        printf("%s took %lf us\n", name.c_str(), (double)(end - start) / 1e6);
-    }
+// The name of the makefile TARGET this was compiled as
+static const char* kernel_name() {
+#if defined(USE_CUDA)
+    return "CUDA";
+#elif defined(USE_AVX) && defined(USE_OMP)
+    return "AVX_OMP";
+#elif defined(USE_AVX)
+    return "AVX";
+#elif defined(USE_OMP)
+    return "OMP";
 #else
-    Timer(std::string _name) {}
+    return "NORMAL";
 #endif
-};
+}
 
 typedef sf::Vector2<double> vec2;
 typedef sf::Vector2<int> vec2i;
 
+// Everything that decides what the iterations of a frame are
+struct View {
+    vec2 scale, offset;
+    int max_iters;
+    int which_set;
+    // sample the screen from the cached tile pyramid instead of computing every pixel directly
+    bool use_tile_cache;
+
+    bool operator==(const View& other) const {
+        return scale == other.scale && offset == other.offset && max_iters == other.max_iters && which_set == other.which_set &&
+               use_tile_cache == other.use_tile_cache;
+    }
+    bool operator!=(const View& other) const { return !(*this == other); }
+};
+
 struct Application {
+    // the number of pixels we compute
+    int width, height;
     std::vector<int> iteration_count;
-    vec2 scale = {400, 400}, offset = {-WIDTH / 2, -HEIGHT / 2};
+    vec2 scale, offset;
+
+    // Bumped every time the view changes, which cancels the frame that is being computed
+    std::atomic<unsigned> generation{0};
+    // How much work was thrown away because of that
+    std::atomic<int> tiles_cancelled{0};
+    int frames_cancelled = 0;
+
+    // Toggled with C
+    bool use_tile_cache = false;
+    // Samples the tile cache from the level with the next finer pixels than the screen's instead of the closest one,
+    // which can be up to 1.4 times coarser. Animations need this, or the resolution goes up and down as they zoom.
+    bool finer_tiles = false;
+    TileCache tile_cache;
+    // Optional, backs tile_cache with tiles on disk
+    std::unique_ptr<TileStore> tile_store;
+    long long tiles_from_disk = 0;
+    long long tiles_prefetched = 0;
+
+    // A rectangle of screen pixels
+    struct Rect {
+        int x, y, width, height;
+    };
+    // When set, update_vec hands out the parts of the frame it has finished as it goes (see take_finished_tiles), so
+    // that they can be shown before the whole frame is. The tile cache only has the iterations at the very end, so it
+    // doesn't do this.
+    bool publish_tiles = false;
+    // Whether update_vec mirrors what it can instead of computing it, see Symmetry
+    bool use_symmetry = true;
+    std::mutex finished_mutex;
+    std::vector<Rect> finished_tiles;
 
     #ifdef USE_CUDA
         int* d_iteration_count;
         dim3 blockDim, gridDim;
     #endif
 
-    Application() : iteration_count(HEIGHT * WIDTH, 0) {
-        offset.x /= scale.x;
-        offset.y /= scale.y;
+    Application(int _width, int _height) : width(_width), height(_height), iteration_count(_height * _width, 0), tile_cache(TILE_CACHE_TILES) {
+        // start with 4 units of the world across the screen, centred on 0
+        scale = {width / 4.0, width / 4.0};
+        offset = {-width / 2 / scale.x, -height / 2 / scale.y};
 
         #ifdef USE_CUDA
             // malloc the memory on the device
-            checkCudaErrors(cudaMalloc(&d_iteration_count, HEIGHT*WIDTH*sizeof(int)));
+            checkCudaErrors(cudaMalloc(&d_iteration_count, height*width*sizeof(int)));
             blockDim.x  = 32;
             blockDim.y  = 32;
-            gridDim.x = WIDTH  / blockDim.x;
-            gridDim.y = HEIGHT / blockDim.y;
+            gridDim.x = (width  + blockDim.x - 1) / blockDim.x;
+            gridDim.y = (height + blockDim.y - 1) / blockDim.y;
         #endif
 
     }
@@ -90,265 +159,480 @@ struct Application {
             ((world.y - offset.y) * scale.y)};
     }
 
-    void update_vec() {
-#ifdef USE_CUDA
-        static_assert (WIDTH % 32 == 0, "invalid shape");
-        // run the cuda code
-        if (WHICH_SET == 0){
-            get_mandelbrot_iters<<<gridDim,blockDim>>>(d_iteration_count, WIDTH, HEIGHT, MAX_ITERS, scale.x, scale.y, offset.x, offset.y);
-        }
-        else {
-            get_julia_iters<<<gridDim,blockDim>>>(d_iteration_count, WIDTH, HEIGHT, MAX_ITERS, scale.x, scale.y, offset.x, offset.y);
+    View current_view() const {
+        return {scale, offset, MAX_ITERS, WHICH_SET, use_tile_cache};
+    }
+
+    // The part of the world covered by the w x h pixels whose top left pixel is (x, y) on screen
+    static Block screen_block(const View& view, int x, int y, int w, int h) {
+        return {
+            x / view.scale.x + view.offset.x,
+            y / view.scale.y + view.offset.y,
+            1 / view.scale.x, 1 / view.scale.y,
+            w, h};
+    }
+
+    // Makes any update_vec that is currently running stop within CANCEL_CHECK_ROWS rows (or at its next tile, with the
+    // tile cache).
+    void cancel() {
+        ++generation;
+    }
+
+    bool is_cancelled(unsigned frame_generation) const {
+        return generation.load(std::memory_order_relaxed) != frame_generation;
+    }
+
+    // Reorders items so that the ones whose centre is closest to focus come first
+    template <typename CentreOf>
+    static void closest_first(std::vector<int>& items, const vec2& focus, CentreOf centre_of) {
+        std::vector<std::pair<double, int>> by_distance;
+        by_distance.reserve(items.size());
+        for (int item : items) {
+            vec2 d = centre_of(item) - focus;
+            by_distance.push_back({d.x * d.x + d.y * d.y, item});
         }
-        checkCudaErrors(cudaDeviceSynchronize());
-        checkCudaErrors(cudaMemcpy(iteration_count.data(), d_iteration_count, HEIGHT*WIDTH*sizeof(int), cudaMemcpyDeviceToHost));
-            
-        return;
-#endif
-#ifdef USE_AVX
-        if (WHICH_SET == 0)
-            do_intrinsics();
-        else
-            do_intrinsics_julia();
-        return;
+        std::sort(by_distance.begin(), by_distance.end());
+        for (size_t i = 0; i < items.size(); ++i)
+            items[i] = by_distance[i].second;
+    }
+
+    // Whether update_vec can colour the pixels itself for this view. The tile cache needs the iterations, and the CUDA
+    // kernels only count iterations.
+    bool can_fuse(const View& view) const {
+#ifdef USE_CUDA
+        return false;
+#else
+        return !view.use_tile_cache;
 #endif
+    }
+
+    void finish_tile(const Rect& rect) {
+        std::lock_guard<std::mutex> lock(finished_mutex);
+        finished_tiles.push_back(rect);
+    }
+
+    // The parts of the frame that update_vec finished since the last call. They won't be written to again by this frame.
+    std::vector<Rect> take_finished_tiles() {
+        std::vector<Rect> tiles;
+        std::lock_guard<std::mutex> lock(finished_mutex);
+        tiles.swap(finished_tiles);
+        return tiles;
+    }
+
+    // Records a tile that was computed from start until now in the trace, with the sum of its iterations if there are
+    // any (a w x h block at `iterations`), see trace.h
+    static void trace_tile(const char* name, long long start, unsigned frame, long long x, long long y, int w, int h,
+                           const int* iterations = nullptr, int stride = 0) {
+        if (!trace.is_enabled())
+            return;
+        const long long end = current_nanoseconds();
+        trace_event({name, kernel_name(), start, end, frame, x, y, w, h, iterations ? sum_iterations(iterations, w, h, stride) : -1});
+    }
 
-// This is the normal, non-avx version
+    // A rectangle of pixels whose iterations are the same as those of other pixels on screen. The Mandelbrot set is the
+    // same above and below the real axis, and the Julia sets are the same after turning them half way around 0, so
+    // when the screen is lined up with those exactly, pixel (x, y) is the same as (mirror_x - x, mirror_y - y) (the
+    // Mandelbrot set leaves x alone). Pixels in the rectangle are copied from there instead of computed.
+    struct Symmetry {
+        bool flip_x;
+        int mirror_x, mirror_y;
+        Rect rect;
+    };
+
+    // Whether the view has a symmetry with a rectangle in it, which is only the case when the axes of symmetry land
+    // exactly on pixels, or exactly in between two
+    bool find_symmetry(const View& view, Symmetry& symmetry) const {
+        auto whole = [](double v, int& out) {
+            const double rounded = std::round(v);
+            if (std::abs(v - rounded) > 1e-6 || std::abs(rounded) > 1e9)
+                return false;
+            out = (int)rounded;
+            return true;
+        };
+        symmetry.flip_x = view.which_set != 0;
+        // world y of row k is offset.y + k / scale.y, so -y of row j is row -2 * offset.y * scale.y - j
+        if (!whole(-2 * view.offset.y * view.scale.y, symmetry.mirror_y))
+            return false;
+        if (symmetry.flip_x && !whole(-2 * view.offset.x * view.scale.x, symmetry.mirror_x))
+            return false;
+        // The rows past the axis copy the rows before it, and with flip_x only the columns whose mirror is on screen
+        const int top = symmetry.mirror_y / 2 + 1, bottom = std::min(symmetry.mirror_y, height - 1);
+        int left = 0, right = width - 1;
+        if (symmetry.flip_x) {
+            left = std::max(0, symmetry.mirror_x - width + 1);
+            right = std::min(width - 1, symmetry.mirror_x);
+        }
+        symmetry.rect = {left, top, right - left + 1, bottom - top + 1};
+        return top <= bottom && left <= right;
+    }
+
+    // Copies the pixels of the symmetry's rectangle from their mirror images in buffer (iteration_count or colours)
+    template <typename T>
+    void mirror(const Symmetry& symmetry, T* buffer) const {
+        const Rect& rect = symmetry.rect;
 #ifdef USE_OMP
 #pragma omp parallel for
 #endif
-        for (int vec_index = 0; vec_index < WIDTH * HEIGHT; ++vec_index) {
-            int x = vec_index % WIDTH;
-            int y = vec_index / HEIGHT;
-            vec2 screen_pos = {(double)x, (double)y};
-            vec2 world_pos = screen_to_world(screen_pos);
-            // now do things
-            int iters;
-            if (WHICH_SET == 0)
-                iters = get_iters(world_pos);
-            else
-                iters = get_iters_julia(world_pos);
-            iteration_count[vec_index] = iters;
+        for (int y = rect.y; y < rect.y + rect.height; ++y) {
+            const T* from = buffer + (size_t)(symmetry.mirror_y - y) * width;
+            T* to = buffer + (size_t)y * width;
+            if (!symmetry.flip_x) {
+                std::copy(from + rect.x, from + rect.x + rect.width, to + rect.x);
+                continue;
+            }
+            for (int x = rect.x; x < rect.x + rect.width; ++x)
+                to[x] = from[symmetry.mirror_x - x];
         }
     }
 
-    int get_iters(vec2 world_pos) {
-        int iters = 0;
-        Complex z = {0, 0};
-        Complex c = {world_pos.x, world_pos.y};
-        for (; iters < MAX_ITERS; ++iters) {
-            z = z.square() + c;
-            if (z.norm_sq() >= 4) break;
+    // Computes the iterations of `view` one TILE_SIZE x TILE_SIZE tile at a time, starting with the tiles closest to
+    // focus (in screen pixels), which is where the user is looking. frame_generation is the value of `generation` when
+    // the frame was started; once that changes, the rest of the tiles that are being computed and the remaining tiles
+    // are skipped and this returns false. iteration_count is then a mix of this and the previous frame.
+    // If colours is given (only when can_fuse), the colours of the pixels from palette are written there instead, and
+    // iteration_count is left alone.
+    // When the view lines up with a symmetry of the set, only the pixels outside of its rectangle are computed, and
+    // the rest are mirrored at the end. That can't be shown a tile at a time, so it isn't done with publish_tiles.
+    bool update_vec(const View& view, unsigned frame_generation, const vec2& focus, const Palette* palette = nullptr, uint32_t* colours = nullptr) {
+        if (view.use_tile_cache)
+            return update_from_tile_cache(view, frame_generation, focus);
+        const int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+        const int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+#ifdef USE_CUDA
+        static_assert (TILE_SIZE % 32 == 0, "invalid shape");
+        // run the cuda code, a row of tiles per launch so that we can stop in between
+        dim3 bandDim(gridDim.x, TILE_SIZE / blockDim.y);
+        std::vector<int> bands(tiles_y);
+        for (int ty = 0; ty < tiles_y; ++ty)
+            bands[ty] = ty;
+        closest_first(bands, {0, focus.y}, [](int ty) { return vec2(0, (ty + 0.5) * TILE_SIZE); });
+        for (int b = 0; b < tiles_y; ++b) {
+            int ty = bands[b];
+            if (is_cancelled(frame_generation)) {
+                tiles_cancelled += (tiles_y - b) * tiles_x;
+                return false;
+            }
+            const long long start = current_nanoseconds();
+            if (view.which_set == 0){
+                get_mandelbrot_iters<<<bandDim,blockDim>>>(d_iteration_count, width, height, view.max_iters, view.scale.x, view.scale.y, view.offset.x, view.offset.y, ty * TILE_SIZE);
+            }
+            else {
+                get_julia_iters<<<bandDim,blockDim>>>(d_iteration_count, width, height, view.max_iters, view.scale.x, view.scale.y, view.offset.x, view.offset.y, ty * TILE_SIZE);
+            }
+            checkCudaErrors(cudaDeviceSynchronize());
+            // copy every band as it is done, so that a cancelled frame still keeps them
+            const int band_offset = ty * TILE_SIZE * width;
+            const int band_height = std::min(TILE_SIZE, height - ty * TILE_SIZE);
+            checkCudaErrors(cudaMemcpy(iteration_count.data() + band_offset, d_iteration_count + band_offset, band_height*width*sizeof(int), cudaMemcpyDeviceToHost));
+            trace_tile("band", start, frame_generation, 0, ty * TILE_SIZE, width, band_height, iteration_count.data() + band_offset, width);
+            if (publish_tiles)
+                finish_tile({0, ty * TILE_SIZE, width, band_height});
         }
+        return true;
+#endif
+        std::vector<int> order(tiles_x * tiles_y);
+        for (int tile = 0; tile < tiles_x * tiles_y; ++tile)
+            order[tile] = tile;
+        closest_first(order, focus, [tiles_x](int tile) {
+            return vec2((tile % tiles_x + 0.5) * TILE_SIZE, (tile / tiles_x + 0.5) * TILE_SIZE);
+        });
 
-        return iters;
-    }
+        Symmetry symmetry;
+        const bool symmetric = use_symmetry && !publish_tiles && find_symmetry(view, symmetry);
+        const bool tracing = trace.is_enabled();
+        // computes a block of pixels CANCEL_CHECK_ROWS rows at a time, so that a few rows at lots of iterations are
+        // the longest it takes to notice that the frame was cancelled, which sets stopped. Returns the sum of their
+        // iterations when tracing.
+        auto compute = [&](int x, int y, int w, int h, bool& stopped) -> long long {
+            long long iterations = 0;
+            for (int row = y; row < y + h && w > 0; row += CANCEL_CHECK_ROWS) {
+                if (is_cancelled(frame_generation)) {
+                    stopped = true;
+                    break;
+                }
+                const int rows = std::min(CANCEL_CHECK_ROWS, y + h - row);
+                Block block = screen_block(view, x, row, w, rows);
+                if (colours) {
+                    colour_block(block, view.max_iters, view.which_set, palette->colours.data(), palette->max_iters, &colours[row * width + x], width);
+                    continue;
+                }
+                iterate_block(block, view.max_iters, view.which_set, &iteration_count[row * width + x], width);
+                if (tracing)
+                    iterations += sum_iterations(&iteration_count[row * width + x], w, rows, width);
+            }
+            return iterations;
+        };
 
-    int get_iters_julia(vec2 world_pos) {
-        int iters = 0;
-        Complex z = {world_pos.x, world_pos.y};
-        Complex c = {-0.8, 0.156};
-        for (; iters < MAX_ITERS; ++iters) {
-            z = z.square() + c;
-            if (z.norm_sq() >= 4) break;
+        int skipped = 0;
+#ifdef USE_OMP
+#pragma omp parallel for schedule(dynamic) reduction(+:skipped)
+#endif
+        for (int i = 0; i < tiles_x * tiles_y; ++i) {
+            if (is_cancelled(frame_generation)) {
+                ++skipped;
+                continue;
+            }
+            int tile = order[i];
+            int x = (tile % tiles_x) * TILE_SIZE;
+            int y = (tile / tiles_x) * TILE_SIZE;
+            const int w = std::min(TILE_SIZE, width - x), h = std::min(TILE_SIZE, height - y);
+            const long long start = tracing ? current_nanoseconds() : 0;
+            long long iterations = 0;
+            bool stopped = false;
+            const Rect& r = symmetry.rect;
+            const int top = symmetric ? std::max(y, r.y) : 0, bottom = symmetric ? std::min(y + h, r.y + r.height) : 0;
+            if (top >= bottom) {
+                iterations = compute(x, y, w, h, stopped);
+            } else {
+                // the parts of the tile above, below, left and right of the symmetry's rectangle
+                iterations = compute(x, y, w, top - y, stopped) + compute(x, bottom, w, y + h - bottom, stopped) +
+                             compute(x, top, std::min(x + w, r.x) - x, bottom - top, stopped);
+                const int right = std::max(x, r.x + r.width);
+                iterations += compute(right, top, x + w - right, bottom - top, stopped);
+            }
+            if (stopped) {
+                ++skipped;
+                if (tracing)
+                    trace_event("cancelled tile", start, current_nanoseconds(), frame_generation);
+                continue;
+            }
+            if (tracing)
+                trace_event({colours ? "fused tile" : "tile", kernel_name(), start, current_nanoseconds(), frame_generation,
+                             x, y, w, h, colours ? -1 : iterations});
+            if (publish_tiles)
+                finish_tile({x, y, w, h});
         }
-        return iters;
+        tiles_cancelled += skipped;
+        if (skipped > 0)
+            return false;
+        if (symmetric) {
+            const long long start = current_nanoseconds();
+            if (colours)
+                mirror(symmetry, colours);
+            else
+                mirror(symmetry, iteration_count.data());
+            trace_event("mirror", start, current_nanoseconds(), frame_generation);
+        }
+        return true;
     }
-#ifdef USE_AVX
-    void do_intrinsics() {
+
+    // Anti-aliases the edges of the first `rows` rows of a frame that was coloured from iteration_count into colours.
+    // Every pixel whose iterations differ from one of its neighbours' by more than ANTIALIAS_THRESHOLD is computed
+    // again at samples x samples points spread over it, and gets the average of their colours. Everywhere else a
+    // single sample is as good as many, so this costs a fraction of supersampling the whole frame. Returns how many
+    // pixels were anti-aliased.
+    long long antialias(const View& view, const Palette& palette, uint32_t* colours, int samples, int rows) {
+        const uint32_t* table = palette.colours.data();
+        const int top = palette.max_iters;
+        long long count = 0;
 #ifdef USE_OMP
-#pragma omp parallel
+#pragma omp parallel for schedule(dynamic) reduction(+:count)
 #endif
-        {
-            // how many threads to split up in
-            int num_threads = omp_get_num_threads();
-
-
-            // the scale in the x and y directions
-            __m256d _xscale = _mm256_set1_pd(1 / scale.x);
-            __m256d _yscale = _mm256_set1_pd(1 / scale.y);
-            
-            // Some variables
-            __m256d zr, zi, cr, ci, temp_zr, temp_zi;
-            __m256d zr2, zi2, norm;
-            __m256d four, two;
-            __m256d x, y, _mask1;
-            __m256i _one, _c, _n, _iterations, _mask2;
-            __m256d onetwothreefour = _mm256_set_pd(0.0, 1.0, 2.0, 3.0);
-
-            // set 4 and 2
-            four = _mm256_set1_pd(4.0);
-            two = _mm256_set1_pd(2.0);
-            _one = _mm256_set1_epi64x(1);
-
-            // What is the top left corner of the screen in world space?
-            vec2 test = {0, 0};
-            double offset_x_in_world = screen_to_world(test).x;
-            double offset_y_in_world = screen_to_world(test).y;
-            
-            // x = [0, 1, 2, 3] * scale + offset. The 0, 1, 2, 3 is to offset each element of our vector, as well as starting 
-            // with the first 4 pixels.
-            x = _mm256_add_pd(_mm256_mul_pd(onetwothreefour, _xscale), _mm256_set1_pd(offset_x_in_world));
-            // How many iterations are there?
-            _iterations = _mm256_set1_epi64x(MAX_ITERS);
-            
-            // similarly for y, set it as the offset, and the + (bracket) serves to split the screen into rows for each thread.
-            y = _mm256_set1_pd(offset_y_in_world + (1 / scale.y * HEIGHT / num_threads * omp_get_thread_num()));
-            // Where should we start and end with our loop
-            int start = omp_get_thread_num() * HEIGHT / num_threads * WIDTH;
-            int end = (omp_get_thread_num() + 1) * HEIGHT / num_threads * WIDTH;
-
-            for (int i = start; i < end; i += 4) {
-                if (i % (WIDTH) == 0 && i != 0) {
-                    // new row, so reset things
-                    // x is again the first four pixels in world space.
-                    x = _mm256_add_pd(_mm256_mul_pd(onetwothreefour, _xscale), _mm256_set1_pd(offset_x_in_world));
-                    // add one to y
-                    y = _mm256_add_pd(y, _yscale);
+        for (int y = 0; y < rows; ++y) {
+            std::vector<int> sub(samples * samples);
+            for (int x = 0; x < width; ++x) {
+                const int n = iteration_count[y * width + x];
+                auto differs = [&](int nx, int ny) {
+                    return nx >= 0 && nx < width && ny >= 0 && ny < rows && std::abs(iteration_count[ny * width + nx] - n) > ANTIALIAS_THRESHOLD;
+                };
+                if (!differs(x - 1, y) && !differs(x + 1, y) && !differs(x, y - 1) && !differs(x, y + 1))
+                    continue;
+                // the pixel's own sample is in the middle of the sub samples
+                Block block = screen_block(view, x, y, samples, samples);
+                block.dx /= samples;
+                block.dy /= samples;
+                block.x0 -= (samples - 1) * block.dx / 2;
+                block.y0 -= (samples - 1) * block.dy / 2;
+                iterate_block(block, view.max_iters, view.which_set, sub.data(), samples);
+                uint32_t r = 0, g = 0, b = 0;
+                for (int s : sub) {
+                    const uint32_t colour = table[s < 0 ? 0 : (s > top ? top : s)];
+                    r += colour & 0xff;
+                    g += (colour >> 8) & 0xff;
+                    b += (colour >> 16) & 0xff;
                 }
-                // now we do the maths
-                // c = x + yi
-                ci = y;
-                cr = x;
-                zr = _mm256_setzero_pd();
-                zi = _mm256_setzero_pd();
-                // the iteration count.
-                _n = _mm256_setzero_si256();
-            repeat:
-                // get zr^2
-                zr2 = _mm256_mul_pd(zr, zr);
-                // get zi^2
-                zi2 = _mm256_mul_pd(zi, zi);
-
-                // new_zr = (zr^2 - zi^2) + cr
-                // new_zi = 2 * (zr * zi) + ci
-                temp_zr = _mm256_add_pd(_mm256_sub_pd(zr2, zi2), cr);
-                temp_zi = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(zr, zi), two), ci);
-                
-                // update
-                zr = temp_zr;
-                zi = temp_zi;
-                // get the norm
-                norm = _mm256_add_pd(zr2, zi2);
-                
-                // Not totally sure what this does, compares first
-                _mask1 = _mm256_cmp_pd(norm, four, _CMP_LT_OQ);
-                _mask2 = _mm256_cmpgt_epi64(_iterations, _n);
-                // cast to integer
-                _mask2 = _mm256_and_si256(_mask2, _mm256_castpd_si256(_mask1));
-                _c = _mm256_and_si256(_one, _mask2);  // Zero out ones where n < iterations
-                _n = _mm256_add_epi64(_n, _c);        // n++ Increase all n
-                if (_mm256_movemask_pd(_mm256_castsi256_pd(_mask2)) > 0)
-                    goto repeat;
-                
-                // then update the iteration count
-                iteration_count[i + 0] = int(_n[3]);
-                iteration_count[i + 1] = int(_n[2]);
-                iteration_count[i + 2] = int(_n[1]);
-                iteration_count[i + 3] = int(_n[0]);
-                // update x
-                x = _mm256_add_pd(x, _mm256_mul_pd(_xscale, four));
+                const uint32_t total = samples * samples;
+                colours[y * width + x] = pack_rgba(r / total, g / total, b / total);
+                ++count;
             }
         }
+        return count;
+    }
+
+    // Computes the iterations of a single block with whatever hardware we have
+    void compute_block(const Block& block, int max_iters, int which_set, int* out, int stride) {
+#ifdef USE_CUDA
+        // the kernels work with a scale and offset, and we use the start of d_iteration_count as scratch space
+        dim3 blockGrid(block.width / blockDim.x, block.height / blockDim.y);
+        if (which_set == 0){
+            get_mandelbrot_iters<<<blockGrid,blockDim>>>(d_iteration_count, block.width, block.height, max_iters, 1 / block.dx, 1 / block.dy, block.x0, block.y0, 0);
+        }
+        else {
+            get_julia_iters<<<blockGrid,blockDim>>>(d_iteration_count, block.width, block.height, max_iters, 1 / block.dx, 1 / block.dy, block.x0, block.y0, 0);
+        }
+        checkCudaErrors(cudaDeviceSynchronize());
+        checkCudaErrors(cudaMemcpy2D(out, stride * sizeof(int), d_iteration_count, block.width * sizeof(int), block.width * sizeof(int), block.height, cudaMemcpyDeviceToHost));
+#else
+        iterate_block(block, max_iters, which_set, out, stride);
+#endif
     }
 
+    // Looks for a tile in memory, and then on disk
+    TileData find_tile(const TileKey& key) {
+        TileData tile = tile_cache.find(key);
+        if (tile || !tile_store)
+            return tile;
+        std::shared_ptr<std::vector<int>> data = std::make_shared<std::vector<int>>(TILE_SIZE * TILE_SIZE);
+        if (!tile_store->read(key, data->data()))
+            return tile;
+        ++tiles_from_disk;
+        tile_cache.insert(key, data);
+        return data;
+    }
+
+    void add_tile(const TileKey& key, const TileData& tile, bool prefetched = false) {
+        tile_cache.insert(key, tile, prefetched);
+        if (tile_store)
+            tile_store->write(key, tile->data());
+    }
+
+    // update_vec with the tile cache on. We work out which tiles of the pyramid level closest to the current scale
+    // (or the next finer one, see finer_tiles) cover the screen, compute the ones that aren't in the cache, and then
+    // sample every screen pixel from the nearest tile pixel.
+    bool update_from_tile_cache(const View& view, unsigned frame_generation, const vec2& focus) {
+        static_assert (TILE_SIZE % 32 == 0, "invalid shape");
+        const int level = finer_tiles ? finer_tile_level_for_scale(view.scale.x) : tile_level_for_scale(view.scale.x);
+        const double tile_pixels_per_unit = 1 / tile_pixel_size(level);
+
+        // Which tile, and which pixel in that tile, every screen column and row lands on
+        std::vector<int64_t> column_pixel(width), row_pixel(height);
+        for (int x = 0; x < width; ++x)
+            column_pixel[x] = (int64_t)std::floor((x / view.scale.x + view.offset.x) * tile_pixels_per_unit + 0.5);
+        for (int y = 0; y < height; ++y)
+            row_pixel[y] = (int64_t)std::floor((y / view.scale.y + view.offset.y) * tile_pixels_per_unit + 0.5);
+        const int64_t tx0 = floor_div(column_pixel.front(), TILE_SIZE), ty0 = floor_div(row_pixel.front(), TILE_SIZE);
+        const int nx = (int)(floor_div(column_pixel.back(), TILE_SIZE) - tx0 + 1);
+        const int ny = (int)(floor_div(row_pixel.back(), TILE_SIZE) - ty0 + 1);
+        auto tile_key = [&](int t) -> TileKey {
+            return {level, tx0 + t % nx, ty0 + t / nx, view.max_iters, view.which_set};
+        };
 
-    void do_intrinsics_julia() {
+        std::vector<TileData> tiles(nx * ny);
+        std::vector<int> missing;
+        for (int t = 0; t < nx * ny; ++t) {
+            tiles[t] = find_tile(tile_key(t));
+            if (!tiles[t])
+                missing.push_back(t);
+        }
+        const double tile_width = TILE_SIZE * tile_pixel_size(level);
+        closest_first(missing, {focus.x / view.scale.x + view.offset.x, focus.y / view.scale.y + view.offset.y}, [&](int t) {
+            return vec2((tx0 + t % nx + 0.5) * tile_width, (ty0 + t / nx + 0.5) * tile_width);
+        });
+
+        int skipped = 0;
 #ifdef USE_OMP
-#pragma omp parallel
+#pragma omp parallel for schedule(dynamic) reduction(+:skipped)
 #endif
-        {
-            // how many threads to split up in
-            int num_threads = omp_get_num_threads();
-
-
-            // the scale in the x and y directions
-            __m256d _xscale = _mm256_set1_pd(1 / scale.x);
-            __m256d _yscale = _mm256_set1_pd(1 / scale.y);
-            
-            // Some variables
-            __m256d zr, zi, cr, ci, temp_zr, temp_zi;
-            __m256d zr2, zi2, norm;
-            __m256d four, two;
-            __m256d x, y, _mask1;
-            __m256i _one, _c, _n, _iterations, _mask2;
-            __m256d onetwothreefour = _mm256_set_pd(0.0, 1.0, 2.0, 3.0);
-
-            cr = _mm256_set1_pd(-0.8);
-            ci = _mm256_set1_pd(0.156);
-            // set 4 and 2
-            four = _mm256_set1_pd(4.0);
-            two = _mm256_set1_pd(2.0);
-            _one = _mm256_set1_epi64x(1);
-
-            // What is the top left corner of the screen in world space?
-            vec2 test = {0, 0};
-            double offset_x_in_world = screen_to_world(test).x;
-            double offset_y_in_world = screen_to_world(test).y;
-            
-            // x = [0, 1, 2, 3] * scale + offset. The 0, 1, 2, 3 is to offset each element of our vector, as well as starting 
-            // with the first 4 pixels.
-            x = _mm256_add_pd(_mm256_mul_pd(onetwothreefour, _xscale), _mm256_set1_pd(offset_x_in_world));
-            // How many iterations are there?
-            _iterations = _mm256_set1_epi64x(MAX_ITERS);
-            
-            // similarly for y, set it as the offset, and the + (bracket) serves to split the screen into rows for each thread.
-            y = _mm256_set1_pd(offset_y_in_world + (1 / scale.y * HEIGHT / num_threads * omp_get_thread_num()));
-            // Where should we start and end with our loop
-            int start = omp_get_thread_num() * HEIGHT / num_threads * WIDTH;
-            int end = (omp_get_thread_num() + 1) * HEIGHT / num_threads * WIDTH;
-
-            for (int i = start; i < end; i += 4) {
-                if (i % (WIDTH) == 0 && i != 0) {
-                    // new row, so reset things
-                    // x is again the first four pixels in world space.
-                    x = _mm256_add_pd(_mm256_mul_pd(onetwothreefour, _xscale), _mm256_set1_pd(offset_x_in_world));
-                    // add one to y
-                    y = _mm256_add_pd(y, _yscale);
-                }
-                // now we do the maths
-                zr = x;
-                zi = y;
-                // the iteration count.
-                _n = _mm256_setzero_si256();
-            repeat:
-                // get zr^2
-                zr2 = _mm256_mul_pd(zr, zr);
-                // get zi^2
-                zi2 = _mm256_mul_pd(zi, zi);
-
-                // new_zr = (zr^2 - zi^2) + cr
-                // new_zi = 2 * (zr * zi) + ci
-                temp_zr = _mm256_add_pd(_mm256_sub_pd(zr2, zi2), cr);
-                temp_zi = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(zr, zi), two), ci);
-                
-                // update
-                zr = temp_zr;
-                zi = temp_zi;
-                // get the norm
-                norm = _mm256_add_pd(zr2, zi2);
-                
-                // Not totally sure what this does, compares first
-                _mask1 = _mm256_cmp_pd(norm, four, _CMP_LT_OQ);
-                _mask2 = _mm256_cmpgt_epi64(_iterations, _n);
-                // cast to integer
-                _mask2 = _mm256_and_si256(_mask2, _mm256_castpd_si256(_mask1));
-                _c = _mm256_and_si256(_one, _mask2);  // Zero out ones where n < iterations
-                _n = _mm256_add_epi64(_n, _c);        // n++ Increase all n
-                if (_mm256_movemask_pd(_mm256_castsi256_pd(_mask2)) > 0)
-                    goto repeat;
-                
-                // then update the iteration count
-                iteration_count[i + 0] = int(_n[3]);
-                iteration_count[i + 1] = int(_n[2]);
-                iteration_count[i + 2] = int(_n[1]);
-                iteration_count[i + 3] = int(_n[0]);
-                // update x
-                x = _mm256_add_pd(x, _mm256_mul_pd(_xscale, four));
+        for (int m = 0; m < (int)missing.size(); ++m) {
+            if (is_cancelled(frame_generation)) {
+                ++skipped;
+                continue;
+            }
+            int t = missing[m];
+            const long long start = current_nanoseconds();
+            std::shared_ptr<std::vector<int>> data = std::make_shared<std::vector<int>>(TILE_SIZE * TILE_SIZE);
+            const TileKey key = tile_key(t);
+            compute_block(tile_block(key, TILE_SIZE), view.max_iters, view.which_set, data->data(), TILE_SIZE);
+            trace_tile("cached tile", start, frame_generation, key.x, key.y, TILE_SIZE, TILE_SIZE, data->data(), TILE_SIZE);
+            tiles[t] = data;
+        }
+        // Keep everything we did finish, even if the frame was cancelled
+        for (int t : missing) {
+            if (tiles[t])
+                add_tile(tile_key(t), tiles[t]);
+        }
+        tiles_cancelled += skipped;
+        if (skipped > 0)
+            return false;
+
+        std::vector<int> column_tile(width), column_offset(width);
+        for (int x = 0; x < width; ++x) {
+            int64_t tx = floor_div(column_pixel[x], TILE_SIZE);
+            column_tile[x] = (int)(tx - tx0);
+            column_offset[x] = (int)(column_pixel[x] - tx * TILE_SIZE);
+        }
+#ifdef USE_OMP
+#pragma omp parallel for
+#endif
+        for (int y = 0; y < height; ++y) {
+            int64_t ty = floor_div(row_pixel[y], TILE_SIZE);
+            const TileData* tile_row = &tiles[(ty - ty0) * nx];
+            const int row_offset = (int)(row_pixel[y] - ty * TILE_SIZE) * TILE_SIZE;
+            int* out = &iteration_count[y * width];
+            for (int x = 0; x < width; ++x)
+                out[x] = (*tile_row[column_tile[x]])[row_offset + column_offset[x]];
+        }
+        return true;
+    }
+
+    // Appends the tiles of `level` that cover the part of the world from top_left to bottom_right
+    static void tiles_covering(const View& view, int level, const vec2& top_left, const vec2& bottom_right, std::vector<TileKey>& keys) {
+        const double tile_width = TILE_SIZE * tile_pixel_size(level);
+        const int64_t x0 = (int64_t)std::floor(top_left.x / tile_width), x1 = (int64_t)std::floor(bottom_right.x / tile_width);
+        const int64_t y0 = (int64_t)std::floor(top_left.y / tile_width), y1 = (int64_t)std::floor(bottom_right.y / tile_width);
+        for (int64_t y = y0; y <= y1; ++y) {
+            for (int64_t x = x0; x <= x1; ++x) {
+                keys.push_back({level, x, y, view.max_iters, view.which_set});
             }
         }
     }
+
+    // The tiles worth computing while the view isn't changing, most useful first: what the screen would show after
+    // zooming in and then out by a factor of 2 around focus (a world position, normally under the mouse), and a margin
+    // of PREFETCH_MARGIN tiles around the screen for panning. Tiles we already have, in memory or on disk, are left out.
+    std::vector<TileKey> prefetch_candidates(const View& view, const vec2& focus) {
+        const int level = tile_level_for_scale(view.scale.x);
+        const vec2 screen_size = {width / view.scale.x, height / view.scale.y};
+        std::vector<TileKey> keys;
+        for (int zoom : {1, -1}) {
+            // one level further in halves the size of everything on screen
+            const double factor = std::ldexp(1.0, -zoom);
+            const vec2 top_left = focus - (focus - view.offset) * factor;
+            tiles_covering(view, level + zoom, top_left, top_left + screen_size * factor, keys);
+        }
+        const double margin = PREFETCH_MARGIN * TILE_SIZE * tile_pixel_size(level);
+        tiles_covering(view, level, view.offset - vec2(margin, margin), view.offset + screen_size + vec2(margin, margin), keys);
+
+        std::vector<TileKey> missing;
+        for (const TileKey& key : keys) {
+            if (!tile_cache.contains(key) && !(tile_store && tile_store->contains(key)))
+                missing.push_back(key);
+        }
+        return missing;
+    }
+
+    // Computes tiles from prefetch_candidates and caches them, stopping as soon as the view changes
+    void prefetch(const std::vector<TileKey>& keys, unsigned frame_generation) {
+        std::vector<TileData> tiles(keys.size());
+#ifdef USE_OMP
+#pragma omp parallel for schedule(dynamic)
 #endif
+        for (int i = 0; i < (int)keys.size(); ++i) {
+            if (is_cancelled(frame_generation))
+                continue;
+            const long long start = current_nanoseconds();
+            std::shared_ptr<std::vector<int>> data = std::make_shared<std::vector<int>>(TILE_SIZE * TILE_SIZE);
+            compute_block(tile_block(keys[i], TILE_SIZE), keys[i].max_iters, keys[i].which_set, data->data(), TILE_SIZE);
+            trace_tile("prefetched tile", start, frame_generation, keys[i].x, keys[i].y, TILE_SIZE, TILE_SIZE, data->data(), TILE_SIZE);
+            tiles[i] = data;
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (tiles[i]) {
+                add_tile(keys[i], tiles[i], true);
+                ++tiles_prefetched;
+            }
+        }
+    }
 
     ~Application(){
         // free the memory on the GPU
@@ -358,20 +642,726 @@ struct Application {
     }
 };
 
+// Something running on its own thread
+struct BackgroundJob {
+    std::thread thread;
+    std::atomic<bool> done{false};
+
+    void start(const std::function<void()>& job) {
+        done = false;
+        thread = std::thread([this, job]() {
+            job();
+            done = true;
+        });
+    }
+
+    bool running() const {
+        return thread.joinable();
+    }
+
+    // Waits for the job, if there is one, to end
+    void wait() {
+        if (running())
+            thread.join();
+    }
+
+    // If the job is done, cleans up after it and returns true
+    bool finished() {
+        if (!running() || !done)
+            return false;
+        thread.join();
+        return true;
+    }
+
+    ~BackgroundJob() {
+        wait();
+    }
+};
+
+// What to render without a window, from the command line
+struct RenderOptions {
+    // the world position in the middle of the image
+    vec2 centre = {0, 0};
+    // pixels per world unit, or 0 for 4 world units across the image like the window starts with
+    double scale = 0;
+    int width = WIDTH, height = HEIGHT;
+    // where the image goes, rendering without a window if it is set
+    std::string output;
+    // render a band at a time and stream it to output, for images too big for memory
+    bool poster = false;
+    // render the zoom path in this file instead of a single image
+    std::string keyframes;
+    // frames per second of a .y4m animation
+    int fps = 30;
+    // render the animation from an exponential map, see ExpMap
+    bool exp_map = false;
+    // also write the iterations of a single image or poster here, see iteration_dump.h
+    std::string dump;
+    // colour the iterations in this dump instead of rendering anything
+    std::string recolour;
+    // anti-alias the edges with this many samples in each direction for every pixel on them, see Application::antialias
+    int antialias = 1;
+    // colour by the distance estimate instead of the iterations, see get_distance_at
+    bool distance = false;
+};
+
+static bool ends_with(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static double seconds_since(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Colours the iterations of a whole frame with the current colour scheme, and returns the palette it used
+static Palette colour_frame(const std::vector<int>& iterations, int max_iters, std::vector<sf::Uint32>& pixels, int width, int height) {
+    Histogram histogram;
+    if (COLOURSCHEME == HISTOGRAM_COLOURSCHEME)
+        histogram.build(iterations.data(), (int)iterations.size(), max_iters);
+    Palette palette;
+    palette.update(max_iters, COLOURSCHEME, 0, &histogram);
+    colour_image(iterations.data(), pixels.data(), width, height, palette);
+    return palette;
+}
+
+// Writes an image as a .png with PngWriter, which compresses on all threads, as the RGBA bytes of every row one after
+// the other if the name ends in .raw, and with sf::Image otherwise (.bmp, .tga or .jpg). Returns whether it worked.
+static bool write_image(const std::string& path, const uint32_t* pixels, int width, int height) {
+    if (ends_with(path, ".png")) {
+        Timer t(STAGE_ENCODE);
+        PngWriter png(path, width, height);
+        if (!png.ok)
+            return false;
+        png.write_rows(pixels, height);
+        return png.close();
+    }
+    if (ends_with(path, ".raw")) {
+        FILE* file = fopen(path.c_str(), "wb");
+        const size_t count = (size_t)width * height;
+        const bool written = file && fwrite(pixels, sizeof(uint32_t), count, file) == count;
+        return file && fclose(file) == 0 && written;
+    }
+    sf::Image image;
+    image.create(width, height, (const sf::Uint8*)pixels);
+    return image.saveToFile(path);
+}
+
+// Colours the first `rows` rows of `view` by their distance estimate, a row per thread at a time
+static void render_distances(const View& view, int width, int rows, uint32_t* pixels) {
+#ifdef USE_OMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int y = 0; y < rows; ++y) {
+        std::vector<float> distances(width);
+        distance_block(Application::screen_block(view, 0, y, width, 1), view.max_iters, view.which_set, distances.data(), width);
+        colour_distances(distances.data(), pixels + (size_t)y * width, width, 1 / view.scale.x);
+    }
+}
+
+// The header of a dump of the iterations of `view`, computed by the kernel this was compiled with
+static DumpHeader dump_header(const View& view, int width, int height) {
+    DumpHeader header;
+    header.width = width;
+    header.height = height;
+    header.max_iters = view.max_iters;
+    header.which_set = view.which_set;
+#if defined(USE_CUDA)
+    header.kernel = DUMP_KERNEL_CUDA;
+#elif defined(USE_AVX)
+    header.kernel = DUMP_KERNEL_AVX;
+#else
+    header.kernel = DUMP_KERNEL_SCALAR;
+#endif
+    header.precision = 8 * sizeof(double);
+    header.offset_x = view.offset.x;
+    header.offset_y = view.offset.y;
+    header.scale_x = view.scale.x;
+    header.scale_y = view.scale.y;
+    return header;
+}
+
+// Renders a single image with the fastest kernel this was compiled with, for batch jobs on machines without a display.
+// The image is written to options.output with write_image. Returns the exit code.
+int render_headless(const RenderOptions& options) {
+    const auto start = std::chrono::steady_clock::now();
+    Application app(options.width, options.height);
+    const double scale = options.scale > 0 ? options.scale : options.width / 4.0;
+    app.scale = {scale, scale};
+    app.offset = options.centre - vec2(options.width / 2.0 / scale, options.height / 2.0 / scale);
+    const View view = app.current_view();
+    std::vector<sf::Uint32> pixels((size_t)options.width * options.height);
+    if (options.distance) {
+        render_distances(view, options.width, options.height, pixels.data());
+        const double seconds = seconds_since(start);
+        if (!write_image(options.output, pixels.data(), options.width, options.height)) {
+            fprintf(stderr, "Could not write %s\n", options.output.c_str());
+            return 1;
+        }
+        printf("Rendered the distance estimates of %dx%d pixels to %s in %lf s (%lf s computing)\n", options.width,
+               options.height, options.output.c_str(), seconds_since(start), seconds);
+        return 0;
+    }
+    // nothing cancels this one
+    app.update_vec(view, app.generation, {options.width / 2.0, options.height / 2.0});
+    const double compute_seconds = seconds_since(start);
+    if (!options.dump.empty()) {
+        IterationDumpWriter dump(options.dump.c_str(), dump_header(view, options.width, options.height));
+        dump.write_rows(app.iteration_count.data(), options.height, options.width);
+        if (!dump.close()) {
+            fprintf(stderr, "Could not write %s\n", options.dump.c_str());
+            return 1;
+        }
+    }
+
+    const Palette palette = colour_frame(app.iteration_count, view.max_iters, pixels, options.width, options.height);
+    long long antialiased = 0;
+    if (options.antialias > 1) {
+        Timer t(STAGE_ANTIALIAS);
+        antialiased = app.antialias(view, palette, pixels.data(), options.antialias, options.height);
+    }
+    const bool saved = write_image(options.output, pixels.data(), options.width, options.height);
+    if (!saved) {
+        fprintf(stderr, "Could not write %s\n", options.output.c_str());
+        return 1;
+    }
+    const double seconds = seconds_since(start);
+    printf("Rendered %dx%d pixels to %s in %lf s (%lf s computing), %lf Mpixel/s\n", options.width, options.height,
+           options.output.c_str(), seconds, compute_seconds, (double)options.width * options.height / 1e6 / seconds);
+    if (options.antialias > 1)
+        printf("Anti-aliased %lld pixels (%lf%%) with %d samples each\n", antialiased,
+               100.0 * antialiased / ((double)options.width * options.height), options.antialias * options.antialias);
+    return 0;
+}
+
+// Renders images of any size (e.g. 100000 x 100000) a band of TILE_SIZE rows at a time, so that only a couple of
+// bands are ever in memory. Every band is computed in parallel like a frame, and then written to the file by another
+// thread while the next one is computed. The file is a PNG if the name ends in .png, and otherwise a binary PPM, which
+// is just the RGB rows one after the other.
+// The histogram colours need the whole image before anything can be coloured, so they turn into plain black and white.
+int render_poster(const RenderOptions& options) {
+    const auto start = std::chrono::steady_clock::now();
+    const int width = options.width, height = options.height;
+    std::unique_ptr<PngWriter> png;
+    FILE* file = nullptr;
+    if (ends_with(options.output, ".png")) {
+        png.reset(new PngWriter(options.output, width, height));
+    } else {
+        file = fopen(options.output.c_str(), "wb");
+        if (file && fprintf(file, "P6\n%d %d\n255\n", width, height) < 0) {
+            fclose(file);
+            file = nullptr;
+        }
+    }
+    if (png ? !png->ok : !file) {
+        fprintf(stderr, "Could not write %s\n", options.output.c_str());
+        return 1;
+    }
+    const double scale = options.scale > 0 ? options.scale : width / 4.0;
+    const vec2 top_left = options.centre - vec2(width / 2.0 / scale, height / 2.0 / scale);
+    // the application only ever sees one band of the image
+    Application band(width, TILE_SIZE);
+    band.scale = {scale, scale};
+    Palette palette;
+    palette.update(MAX_ITERS, COLOURSCHEME);
+    std::unique_ptr<IterationDumpWriter> dump;
+    if (!options.dump.empty()) {
+        band.offset = top_left;
+        dump.reset(new IterationDumpWriter(options.dump.c_str(), dump_header(band.current_view(), width, height)));
+    }
+
+    // one band is being coloured while the other one is written
+    std::vector<uint32_t> colours[2] = {std::vector<uint32_t>((size_t)width * TILE_SIZE), std::vector<uint32_t>((size_t)width * TILE_SIZE)};
+    std::thread writer;
+    bool written = true;
+    auto write_band = [&png, file, width, &written](const uint32_t* band_colours, int rows) {
+        if (png) {
+            png->write_rows(band_colours, rows);
+            return;
+        }
+        std::vector<uint8_t> rgb((size_t)width * 3);
+        for (int y = 0; y < rows; ++y) {
+            const uint32_t* row = band_colours + (size_t)y * width;
+            for (int x = 0; x < width; ++x) {
+                rgb[3 * x] = row[x] & 0xff;
+                rgb[3 * x + 1] = (row[x] >> 8) & 0xff;
+                rgb[3 * x + 2] = (row[x] >> 16) & 0xff;
+            }
+            written = written && fwrite(rgb.data(), 1, rgb.size(), file) == rgb.size();
+        }
+    };
+
+    const int bands = (height + TILE_SIZE - 1) / TILE_SIZE;
+    for (int b = 0; b < bands; ++b) {
+        const int y0 = b * TILE_SIZE;
+        const int rows = std::min(TILE_SIZE, height - y0);
+        band.offset = {top_left.x, top_left.y + y0 / scale};
+        std::vector<uint32_t>& band_colours = colours[b % 2];
+        if (options.distance) {
+            render_distances(band.current_view(), width, rows, band_colours.data());
+        } else {
+            band.update_vec(band.current_view(), band.generation, {width / 2.0, 0});
+            if (dump)
+                dump->write_rows(band.iteration_count.data(), rows, width);
+            colour_image(band.iteration_count.data(), band_colours.data(), width, rows, palette);
+            // the edges between bands are left alone, since only one band is in memory
+            if (options.antialias > 1)
+                band.antialias(band.current_view(), palette, band_colours.data(), options.antialias, rows);
+        }
+        // the writer has to be done with the previous band before it can start on this one
+        if (writer.joinable())
+            writer.join();
+        writer = std::thread(write_band, band_colours.data(), rows);
+        if (b % 16 == 15)
+            fprintf(stderr, "\r%d of %d rows", y0 + rows, height);
+    }
+    if (writer.joinable())
+        writer.join();
+    written = png ? png->close() : fclose(file) == 0 && written;
+    if (!written) {
+        fprintf(stderr, "\nCould not write %s\n", options.output.c_str());
+        return 1;
+    }
+    if (dump && !dump->close()) {
+        fprintf(stderr, "\nCould not write %s\n", options.dump.c_str());
+        return 1;
+    }
+    const double seconds = seconds_since(start);
+    printf("\nRendered %dx%d pixels to %s in %lf s, %lf Mpixel/s\n", width, height, options.output.c_str(), seconds,
+           (double)width * height / 1e6 / seconds);
+    return 0;
+}
+
+// Colours the iterations of a dump with the current colour scheme and writes them to options.output like a render
+int recolour_dump(const RenderOptions& options) {
+    const auto start = std::chrono::steady_clock::now();
+    IterationDump dump(options.recolour.c_str());
+    if (!dump.is_open())
+        return 1;
+    const DumpHeader& header = dump.header();
+    const int width = header.width, height = header.height;
+    Histogram histogram;
+    if (COLOURSCHEME == HISTOGRAM_COLOURSCHEME)
+        histogram.build(dump.iterations(), (int)header.pixels(), header.max_iters);
+    Palette palette;
+    palette.update(header.max_iters, COLOURSCHEME, 0, &histogram);
+
+    bool written;
+    if (ends_with(options.output, ".png")) {
+        // a band at a time, so that dumps of any size can be recoloured
+        PngWriter png(options.output, width, height);
+        std::vector<uint32_t> colours((size_t)width * TILE_SIZE);
+        for (int y0 = 0; png.ok && y0 < height; y0 += TILE_SIZE) {
+            const int rows = std::min(TILE_SIZE, height - y0);
+            colour_image(dump.iterations() + (size_t)y0 * width, colours.data(), width, rows, palette);
+            png.write_rows(colours.data(), rows);
+        }
+        written = png.close();
+    } else {
+        std::vector<uint32_t> colours(header.pixels());
+        colour_image(dump.iterations(), colours.data(), width, height, palette);
+        written = write_image(options.output, colours.data(), width, height);
+    }
+    if (!written) {
+        fprintf(stderr, "Could not write %s\n", options.output.c_str());
+        return 1;
+    }
+    printf("Recoloured %dx%d pixels from %s to %s in %lf s\n", width, height, options.recolour.c_str(), options.output.c_str(),
+           seconds_since(start));
+    return 0;
+}
+
+// A point on the zoom path of an animation: at `frame`, the middle of the image is `centre`, at `scale` pixels per unit
+struct Keyframe {
+    int frame;
+    vec2 centre;
+    double scale;
+};
+
+// Reads a file with a "frame x y scale" line for every keyframe, in the order of their frames
+static bool read_keyframes(const std::string& path, std::vector<Keyframe>& keyframes) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file)
+        return false;
+    Keyframe keyframe;
+    while (fscanf(file, "%d %lf %lf %lf", &keyframe.frame, &keyframe.centre.x, &keyframe.centre.y, &keyframe.scale) == 4) {
+        if (keyframe.scale <= 0 || (!keyframes.empty() && keyframe.frame <= keyframes.back().frame))
+            break;
+        keyframes.push_back(keyframe);
+    }
+    const bool read_all = feof(file);
+    fclose(file);
+    return read_all && !keyframes.empty();
+}
+
+// Where the zoom path is at a frame. In between two keyframes the scale changes by the same factor every frame, which
+// looks like a steady zoom, and the centre moves in step with how much the view has shrunk, so that it doesn't race
+// across the screen at the deep end.
+static Keyframe keyframe_at(const std::vector<Keyframe>& keyframes, int frame) {
+    for (size_t i = 1; i < keyframes.size(); ++i) {
+        const Keyframe& a = keyframes[i - 1];
+        const Keyframe& b = keyframes[i];
+        if (frame > b.frame)
+            continue;
+        const double t = std::max(0.0, (double)(frame - a.frame) / (b.frame - a.frame));
+        const double scale = a.scale * std::pow(b.scale / a.scale, t);
+        const double moved = a.scale == b.scale ? t : (1 / a.scale - 1 / scale) / (1 / a.scale - 1 / b.scale);
+        return {frame, a.centre + (b.centre - a.centre) * moved, scale};
+    }
+    return {frame, keyframes.back().centre, keyframes.back().scale};
+}
+
+// The name of numbered images, e.g. frame%04d.png: what comes before and after the number, and how many digits it is
+// padded to with zeros
+struct FramePattern {
+    std::string before, after;
+    int digits = 0;
+
+    // Returns whether pattern has exactly one %d or %0Nd in it, and no other %
+    bool parse(const std::string& pattern) {
+        const size_t percent = pattern.find('%');
+        if (percent == std::string::npos)
+            return false;
+        size_t i = percent + 1;
+        digits = 0;
+        if (i < pattern.size() && pattern[i] == '0') {
+            ++i;
+            const size_t digits_start = i;
+            while (i < pattern.size() && isdigit((unsigned char)pattern[i]) && i - digits_start < 2)
+                digits = digits * 10 + (pattern[i++] - '0');
+            if (i == digits_start)
+                return false;
+        }
+        if (i >= pattern.size() || pattern[i] != 'd')
+            return false;
+        before = pattern.substr(0, percent);
+        after = pattern.substr(i + 1);
+        return after.find('%') == std::string::npos;
+    }
+
+    std::string path(int frame) const {
+        char number[32];
+        snprintf(number, sizeof(number), "%0*d", digits, frame);
+        return before + number + after;
+    }
+};
+
+// Renders every frame from the first to the last keyframe, to a .y4m video or to numbered images when the output has
+// a number in it (see FramePattern).
+// Consecutive frames mostly need the same tiles of the pyramid, so the frames are sampled from the tile cache, and
+// every frame only computes the tiles that the ones before it didn't have. When the frames are too small to keep
+// every core busy, several of them are rendered at once instead, each by its own application on a single thread.
+// With options.exp_map, a zoom into a single point is sampled from an exponential map of it instead.
+int render_animation(const RenderOptions& options, const std::vector<Keyframe>& keyframes) {
+    const auto start = std::chrono::steady_clock::now();
+    const int width = options.width, height = options.height;
+    const int first = keyframes.front().frame;
+    const int frames = keyframes.back().frame - first + 1;
+    std::unique_ptr<Y4mWriter> y4m;
+    FramePattern pattern;
+    if (ends_with(options.output, ".y4m")) {
+        y4m.reset(new Y4mWriter(options.output, width, height, options.fps));
+        if (!y4m->ok) {
+            fprintf(stderr, "Could not write %s\n", options.output.c_str());
+            return 1;
+        }
+    } else if (!pattern.parse(options.output)) {
+        fprintf(stderr, "An animation goes to a .y4m file or numbered images with one %%d or %%0Nd in the name, e.g. --output frame%%04d.png\n");
+        return 1;
+    }
+
+#ifdef USE_OMP
+    const int threads = omp_get_max_threads();
+#else
+    const int threads = 1;
+#endif
+    const int tiles = ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+    int batch = tiles < SMALL_FRAME_TILES * threads ? std::min(threads, frames) : 1;
+    std::unique_ptr<ExpMap> exp_map;
+    if (options.exp_map) {
+        double min_scale = keyframes.front().scale, max_scale = min_scale;
+        for (const Keyframe& keyframe : keyframes) {
+            if (keyframe.centre != keyframes.front().centre) {
+                fprintf(stderr, "--exp-map only works for zooming into a single point, every keyframe needs the same centre\n");
+                return 1;
+            }
+            min_scale = std::min(min_scale, keyframe.scale);
+            max_scale = std::max(max_scale, keyframe.scale);
+        }
+        // the strip goes from the corners of the frame that is zoomed out the furthest inwards to the frame that is
+        // zoomed in the furthest, with a sample for every pixel around the circle through those corners
+        const double half_diagonal = std::sqrt((double)width * width + (double)height * height) / 2;
+        exp_map.reset(new ExpMap(keyframes.front().centre.x, keyframes.front().centre.y, half_diagonal / min_scale, 1 / max_scale,
+                                 ((int)std::ceil(2 * M_PI * half_diagonal) + 3) & ~3, MAX_ITERS, WHICH_SET, width, height));
+        // the map computes its rows in parallel itself
+        batch = 1;
+    }
+    std::vector<std::unique_ptr<Application>> apps;
+    std::vector<std::vector<sf::Uint32>> pixels;
+    for (int i = 0; i < batch; ++i) {
+        apps.emplace_back(new Application(width, height));
+        apps.back()->use_tile_cache = true;
+        apps.back()->finer_tiles = true;
+        pixels.emplace_back((size_t)width * height);
+    }
+
+    bool written = true;
+    for (int f0 = 0; f0 < frames; f0 += batch) {
+        const int count = std::min(batch, frames - f0);
+#ifdef USE_OMP
+#pragma omp parallel for schedule(static, 1) if (count > 1)
+#endif
+        for (int i = 0; i < count; ++i) {
+            // inside of this loop, update_vec and colour_frame only get a single thread
+            Application& app = *apps[i];
+            const Keyframe keyframe = keyframe_at(keyframes, first + f0 + i);
+            app.scale = {keyframe.scale, keyframe.scale};
+            app.offset = keyframe.centre - vec2(width / 2.0 / keyframe.scale, height / 2.0 / keyframe.scale);
+            const View view = app.current_view();
+            if (exp_map)
+                exp_map->sample_frame(1 / keyframe.scale, app.iteration_count.data());
+            else
+                app.update_vec(view, app.generation, {width / 2.0, height / 2.0});
+            const Palette palette = colour_frame(app.iteration_count, view.max_iters, pixels[i], width, height);
+            if (options.antialias > 1)
+                app.antialias(view, palette, pixels[i].data(), options.antialias, height);
+        }
+        // the frames go out in order
+        for (int i = 0; i < count; ++i) {
+            if (y4m) {
+                y4m->write_frame(pixels[i].data());
+                continue;
+            }
+            const std::string path = pattern.path(first + f0 + i);
+            if (!write_image(path, pixels[i].data(), width, height)) {
+                fprintf(stderr, "\nCould not write %s\n", path.c_str());
+                written = false;
+            }
+        }
+        fprintf(stderr, "\r%d of %d frames", f0 + count, frames);
+    }
+    if (y4m && !y4m->close()) {
+        fprintf(stderr, "\nCould not write %s\n", options.output.c_str());
+        written = false;
+    }
+    long long computed = 0, reused = 0;
+    for (const std::unique_ptr<Application>& app : apps) {
+        computed += app->tile_cache.misses;
+        reused += app->tile_cache.hits;
+    }
+    const double seconds = seconds_since(start);
+    printf("\nRendered %d frames of %dx%d pixels in %lf s, %lf frames/s", frames, width, height, seconds, frames / seconds);
+    if (exp_map)
+        printf(", computed %lld rows of %d of the exponential map and the last frame, as many pixels as %lf frames\n",
+               exp_map->rows_computed, exp_map->width, (double)exp_map->points_computed() / ((double)width * height));
+    else
+        printf(", %lld tiles computed and %lld reused\n", computed, reused);
+    return written ? 0 : 1;
+}
+
+// What to time with --bench, see bench.h
+struct BenchOptions {
+    int trials = 5;
+    int width = 800, height = 800;
+    // where the results also go, if set
+    std::string csv, json;
+    // a CSV of earlier results to compare with, and how much slower than them a scenario may get, see compare_with_baseline
+    std::string baseline;
+    double tolerance = 0.05;
+};
+
+// Times every scenario in BENCH_SCENARIOS with the kernel this was compiled with, for 1, 2, 4, ... threads and all of
+// them, and prints and writes the results. Returns the exit code, which is 2 if a scenario got slower than the baseline.
+int run_benchmarks(const BenchOptions& options) {
+    std::vector<BenchBaseline> baseline;
+    if (!options.baseline.empty() && !read_bench_csv(options.baseline, baseline)) {
+        fprintf(stderr, "Could not read %s, it should be a CSV written by --bench-csv\n", options.baseline.c_str());
+        return 1;
+    }
+    std::vector<int> thread_counts = {1};
+#ifdef USE_OMP
+    const int max_threads = omp_get_max_threads();
+    for (int t = 2; t < max_threads; t *= 2)
+        thread_counts.push_back(t);
+    if (max_threads > 1)
+        thread_counts.push_back(max_threads);
+#endif
+    Application app(options.width, options.height);
+    // several scenarios are centred on the real axis, and every pixel should be computed by the kernel for the times
+    // (and the iterations per second) to be comparable between kernels
+    app.use_symmetry = false;
+    std::vector<BenchResult> results;
+    for (int threads : thread_counts) {
+#ifdef USE_OMP
+        omp_set_num_threads(threads);
+#endif
+        for (const BenchScenario& scenario : BENCH_SCENARIOS) {
+            const double scale = options.width / scenario.across;
+            const vec2 offset = vec2(scenario.centre_x, scenario.centre_y) - vec2(options.width / 2.0 / scale, options.height / 2.0 / scale);
+            const View view = {{scale, scale}, offset, scenario.max_iters, scenario.which_set, false};
+            BenchResult result = {kernel_name(), threads, scenario.name, options.width, options.height, scenario.max_iters, {}, 0};
+            // the first one warms up the caches and the threads, and isn't counted
+            for (int trial = -1; trial < options.trials; ++trial) {
+                const auto start = std::chrono::steady_clock::now();
+                app.update_vec(view, app.generation, {options.width / 2.0, options.height / 2.0});
+                if (trial >= 0)
+                    result.seconds.push_back(seconds_since(start));
+            }
+            for (int count : app.iteration_count)
+                result.iterations += count;
+            results.push_back(result);
+            fprintf(stderr, "\r%s with %d threads: %s     ", result.kernel.c_str(), threads, scenario.name);
+        }
+    }
+    fprintf(stderr, "\n");
+    print_bench_table(results);
+    if (!options.csv.empty() && !write_bench_csv(options.csv, results)) {
+        fprintf(stderr, "Could not write %s\n", options.csv.c_str());
+        return 1;
+    }
+    if (!options.json.empty() && !write_bench_json(options.json, results)) {
+        fprintf(stderr, "Could not write %s\n", options.json.c_str());
+        return 1;
+    }
+    if (!options.baseline.empty() && compare_with_baseline(results, baseline, options.tolerance) > 0)
+        return 2;
+    return 0;
+}
+
 int main(int argc, char** argv) {
-    if (argc == 2) {
-        WHICH_SET = atoi(argv[1]);
-    }else if (argc == 3){
-        WHICH_SET  = atoi(argv[1]);
-        COLOURSCHEME = atoi(argv[2]);
+    // The set and colour scheme are positional, everything else is a --name value option
+    std::vector<std::string> positional;
+    const char* tile_store_path = nullptr;
+    // how many pixels on screen every computed pixel takes up in each direction
+    int size = DEFAULT_PIXEL_SIZE;
+    // colour the pixels in the kernels when we can, instead of going through iteration_count
+    bool fused = false;
+    // show every tile of a frame as soon as it is done
+    bool progressive = false;
+    RenderOptions render;
+    // time the kernel instead of showing anything
+    bool bench = false;
+    // record a trace, and write it here, see trace.h
+    std::string trace_path;
+    BenchOptions bench_options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--tile-store" && i + 1 < argc) {
+            tile_store_path = argv[++i];
+        } else if (arg == "--pixel-size" && i + 1 < argc) {
+            size = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--fused") {
+            fused = true;
+        } else if (arg == "--progressive") {
+            progressive = true;
+        } else if (arg == "--output" && i + 1 < argc) {
+            render.output = argv[++i];
+        } else if (arg == "--centre" && i + 2 < argc) {
+            render.centre.x = atof(argv[++i]);
+            render.centre.y = atof(argv[++i]);
+        } else if (arg == "--scale" && i + 1 < argc) {
+            render.scale = atof(argv[++i]);
+        } else if (arg == "--size" && i + 2 < argc) {
+            render.width = std::max(1, atoi(argv[++i]));
+            render.height = std::max(1, atoi(argv[++i]));
+            bench_options.width = render.width;
+            bench_options.height = render.height;
+        } else if (arg == "--keyframes" && i + 1 < argc) {
+            render.keyframes = argv[++i];
+        } else if (arg == "--fps" && i + 1 < argc) {
+            render.fps = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--dump" && i + 1 < argc) {
+            render.dump = argv[++i];
+        } else if (arg == "--recolour" && i + 1 < argc) {
+            render.recolour = argv[++i];
+        } else if (arg == "--antialias" && i + 1 < argc) {
+            render.antialias = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--distance") {
+            render.distance = true;
+        } else if (arg == "--exp-map") {
+            render.exp_map = true;
+        } else if (arg == "--poster") {
+            render.poster = true;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (arg == "--bench") {
+            bench = true;
+        } else if (arg == "--trials" && i + 1 < argc) {
+            bench_options.trials = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--bench-csv" && i + 1 < argc) {
+            bench_options.csv = argv[++i];
+        } else if (arg == "--bench-json" && i + 1 < argc) {
+            bench_options.json = argv[++i];
+        } else if (arg == "--bench-baseline" && i + 1 < argc) {
+            bench_options.baseline = argv[++i];
+        } else if (arg == "--bench-tolerance" && i + 1 < argc) {
+            bench_options.tolerance = std::max(0.0, atof(argv[++i]) / 100);
+        } else if (arg == "--iters" && i + 1 < argc) {
+            MAX_ITERS = std::max(1, atoi(argv[++i]));
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() >= 1) {
+        WHICH_SET = atoi(positional[0].c_str());
     }
+    if (positional.size() >= 2) {
+        COLOURSCHEME = atoi(positional[1].c_str());
+    }
+    if (!trace_path.empty()) {
+        trace.enable();
+        trace_thread_name("main");
+    }
+    auto write_trace = [&]() {
+        if (trace_path.empty())
+            return;
+        if (trace.write_json(trace_path))
+            printf("Wrote the trace to %s\n", trace_path.c_str());
+        else
+            fprintf(stderr, "Could not write %s\n", trace_path.c_str());
+    };
+    // the modes without a window write the trace when they are done
+    auto finish = [&](int code) {
+        write_trace();
+        return code;
+    };
+    if (bench)
+        return finish(run_benchmarks(bench_options));
     printf("Running with set = %d\n", WHICH_SET);
-    const int size = 2;
+    if ((render.poster || !render.keyframes.empty() || !render.recolour.empty()) && render.output.empty()) {
+        fprintf(stderr, "--poster, --keyframes and --recolour need an --output file\n");
+        return 1;
+    }
+    if (!render.recolour.empty())
+        return finish(recolour_dump(render));
+    if (render.distance && (!render.dump.empty() || render.antialias > 1 || !render.keyframes.empty())) {
+        fprintf(stderr, "--distance doesn't count iterations, so it can't be used with --dump, --antialias or --keyframes\n");
+        return 1;
+    }
+    if (!render.keyframes.empty()) {
+        std::vector<Keyframe> keyframes;
+        if (!read_keyframes(render.keyframes, keyframes)) {
+            fprintf(stderr, "Could not read the keyframes in %s, they are \"frame x y scale\" lines in order\n", render.keyframes.c_str());
+            return 1;
+        }
+        return finish(render_animation(render, keyframes));
+    }
+    if (!render.output.empty())
+        return finish(render.poster ? render_poster(render) : render_headless(render));
 
-    const int WIDTH_IMAGE = WIDTH * size;
-    const int HEIGHT_IMAGE = HEIGHT * size;
+    const int WIDTH_IMAGE = WIDTH * DEFAULT_PIXEL_SIZE;
+    const int HEIGHT_IMAGE = HEIGHT * DEFAULT_PIXEL_SIZE;
 
-    Application app;
+    Application app(WIDTH_IMAGE / size, HEIGHT_IMAGE / size);
+    app.publish_tiles = progressive;
+    if (tile_store_path) {
+        app.tile_store.reset(new TileStore(tile_store_path, TILE_SIZE));
+        if (app.tile_store->is_open()) {
+            // there is no point in having tiles on disk if we don't use them
+            app.use_tile_cache = true;
+        } else {
+            app.tile_store.reset();
+        }
+    }
     sf::RenderWindow window;
     sf::Font font;
     if (!font.loadFromFile("src/arial.ttf")) {
@@ -392,121 +1382,307 @@ int main(int argc, char** argv) {
     sf::Sprite sprite;
     sf::Texture tex;
 
-    tex.create(WIDTH_IMAGE, HEIGHT_IMAGE);
+    // The texture is as big as what we compute, and the sprite scales it up to the window
+    tex.create(app.width, app.height);
     sprite.setTexture(tex);
-    std::vector<sf::Uint8> pixels(WIDTH_IMAGE * HEIGHT_IMAGE * 4);
-    int time_now = current_microseconds();
-    while (window.isOpen()) {
-        Timer T("Entire Loop");
-        sf::Vector2i _mouse_pos = sf::Mouse::getPosition(window);
-        while (window.pollEvent(event)) {
-            vec2 mouse = {(double)_mouse_pos.x / size, (double)_mouse_pos.y / size};
-            if (event.type == sf::Event::Closed)
-                window.close();
-            if (event.type == sf::Event::MouseButtonPressed) {
-                start_pan.x = mouse.x;
-                start_pan.y = mouse.y;
-                is_holding_down = true;
-            } else if (event.type == sf::Event::MouseButtonReleased) {
-                is_holding_down = false;
+    sprite.setScale(size, size);
+    Palette palette;
+    // cycle the colours of the palette, toggled with P
+    bool cycle_palette = false;
+    std::vector<sf::Uint32> pixels(app.width * app.height);
+    // Handles a single event. Returns true if it changed the view, i.e. the frame being computed is no longer wanted.
+    auto handle_event = [&](const sf::Event& event, const vec2& mouse) -> bool {
+        View before = app.current_view();
+        if (event.type == sf::Event::Closed) {
+            window.close();
+            return true;
+        }
+        if (event.type == sf::Event::MouseButtonPressed) {
+            start_pan.x = mouse.x;
+            start_pan.y = mouse.y;
+            is_holding_down = true;
+        } else if (event.type == sf::Event::MouseButtonReleased) {
+            is_holding_down = false;
+        }
+
+        if (is_holding_down) {
+            auto d = mouse - start_pan;
+            d.x /= app.scale.x;
+            d.y /= app.scale.y;
+            app.offset = app.offset - (d);
+            start_pan.x = mouse.x;
+            start_pan.y = mouse.y;
+        }
+        vec2 mouse_in_world_before_zoom = app.screen_to_world(mouse);
+
+        if (event.type == sf::Event::MouseWheelScrolled) {
+            if (event.mouseWheelScroll.delta > 0) {
+                app.scale *= 1.1;
+            } else {
+                app.scale *= 0.9;
             }
+        }
+
+
+        if (event.type == sf::Event::KeyPressed) {
+            if (event.key.code == sf::Keyboard::Key::Q) {
+                app.scale *= 1.1;
+            } else if (event.key.code == sf::Keyboard::Key::A) {
+                app.scale *= 0.9;
+            } else if (event.key.code == sf::Keyboard::Key::N) {
+                MAX_ITERS += 32;
+            } else if (event.key.code == sf::Keyboard::Key::M) {
+                MAX_ITERS = std::max(32, MAX_ITERS - 32);
+            } else if (event.key.code == sf::Keyboard::Key::C) {
+                app.use_tile_cache = !app.use_tile_cache;
+            } else if (event.key.code == sf::Keyboard::Key::K) {
+                COLOURSCHEME = (COLOURSCHEME + 1) % NUM_COLOURSCHEMES;
+            } else if (event.key.code == sf::Keyboard::Key::P) {
+                cycle_palette = !cycle_palette;
+            } else if (event.key.code == sf::Keyboard::Key::S) {
+                print_stage_stats(stdout);
+            } else if (event.key.code == sf::Keyboard::Key::T) {
+                write_trace();
+            }
+        }
+        vec2 mouse_in_world_after_zoom = app.screen_to_world(mouse);
+        auto diff = mouse_in_world_before_zoom - mouse_in_world_after_zoom;
+        app.offset += diff;
+        return app.current_view() != before;
+    };
+    auto mouse_position = [&]() -> vec2 {
+        sf::Vector2i _mouse_pos = sf::Mouse::getPosition(window);
+        return vec2{(double)_mouse_pos.x / size, (double)_mouse_pos.y / size};
+    };
+
+    // The frame pipeline is input -> compute -> colour -> upload -> draw. Computing happens on the worker thread, so
+    // while it works on the next frame this thread keeps handling input and drawing the last one.
+    BackgroundJob job;
+    bool job_is_frame = false;
+    // Filled in by a frame on the worker thread
+    View frame_view = app.current_view();
+    bool frame_done = false;
+    double frame_seconds = 0;
+
+    // The view of the last frame that was computed completely. Until it changes, there is no need to compute another
+    View last_frame = app.current_view();
+    bool have_frame = false;
+    // whether the frame being computed writes the pixels directly instead of its iterations
+    bool pixels_from_kernels = false;
+    // The palette the worker uses for those, since the one on screen can change while it runs
+    Palette frame_palette;
+    // The iterations of the frame on screen. The worker computes the next frame into app.iteration_count, and the two
+    // are swapped when it is done, so that we can recolour the frame on screen while the next one is being computed.
+    // After a frame that wrote its pixels directly, these are out of date.
+    std::vector<int> shown_iterations(app.width * app.height, 0);
+    bool shown_iterations_current = false;
+    // the histogram of shown_iterations, only counted while it is needed for the colours
+    Histogram histogram;
+    bool histogram_current = false;
+    bool recolour = false, upload = false;
+    float palette_phase = 0;
+    // Whether the frame being computed is shown a tile at a time, and whether any of its tiles are on screen yet
+    bool progressive_frame = false, frame_on_screen = false;
+    // A tile's worth of pixels, since texture updates want the pixels of the rectangle next to each other
+    std::vector<sf::Uint32> tile_pixels;
+
+    // The view and mouse position that tiles were last prefetched for. Everything prefetch_candidates found for them
+    // was computed then (or the view changed, which cancels it), so they are only looked for again once either moves.
+    View prefetch_view = app.current_view();
+    vec2 prefetch_mouse = mouse_position();
+    bool prefetched = false;
 
-            if (is_holding_down) {
-                auto d = mouse - start_pan;
-                d.x /= app.scale.x;
-                d.y /= app.scale.y;
-                app.offset = app.offset - (d);
-                start_pan.x = mouse.x;
-                start_pan.y = mouse.y;
+    bool redraw = true;
+    // Puts the tiles that the worker finished on screen. Only the texture rectangles of those tiles are uploaded.
+    auto show_finished_tiles = [&]() {
+        for (const Application::Rect& rect : app.take_finished_tiles()) {
+            Timer t(STAGE_UPLOAD);
+            tile_pixels.resize(rect.width * rect.height);
+            for (int y = rect.y; y < rect.y + rect.height; ++y) {
+                const int row = y * app.width + rect.x;
+                if (!pixels_from_kernels) {
+                    // the iterations of this tile are final, so they are now the ones on screen
+                    if (histogram_current)
+                        histogram.replace(&shown_iterations[row], &app.iteration_count[row], rect.width);
+                    std::copy(&app.iteration_count[row], &app.iteration_count[row] + rect.width, &shown_iterations[row]);
+                    colour_iterations(&shown_iterations[row], &pixels[row], rect.width, palette);
+                }
+                std::copy(&pixels[row], &pixels[row] + rect.width, &tile_pixels[(y - rect.y) * rect.width]);
+            }
+            tex.update((const sf::Uint8*)tile_pixels.data(), rect.width, rect.height, rect.x, rect.y);
+            frame_on_screen = true;
+            redraw = true;
+        }
+    };
+    double seconds_to_generate = 0;
+    // the worker changes the cache while it runs, so the stats text shows the numbers from when it last finished
+    std::string cache_stats;
+    long long last_draw = current_nanoseconds();
+    while (window.isOpen()) {
+        // Input. Anything that changes the view cancels whatever the worker is doing.
+        vec2 mouse = mouse_position();
+        {
+            Timer t(STAGE_EVENTS);
+            while (window.pollEvent(event)) {
+                if (handle_event(event, mouse))
+                    app.cancel();
             }
-            vec2 mouse_in_world_before_zoom = app.screen_to_world(mouse);
+        }
+        if (!window.isOpen())
+            break;
 
-            if (event.type == sf::Event::MouseWheelScrolled) {
-                if (event.mouseWheelScroll.delta > 0) {
-                    app.scale *= 1.1;
+        // Compute: pick up what the worker finished
+        if (job_is_frame && progressive_frame)
+            show_finished_tiles();
+        if (job.finished()) {
+            if (job_is_frame && progressive_frame)
+                show_finished_tiles();
+            if (job_is_frame && frame_done) {
+                last_frame = frame_view;
+                have_frame = true;
+                // the pixels on screen are now in the colours of the frame's palette, so only a change of scheme or
+                // phase since the frame started needs them recoloured (which for these means computing them again)
+                if (pixels_from_kernels)
+                    palette = frame_palette;
+                if (progressive_frame) {
+                    // every tile is on screen already
+                    shown_iterations_current = !pixels_from_kernels;
+                } else if (pixels_from_kernels) {
+                    shown_iterations_current = false;
+                    upload = true;
                 } else {
-                    app.scale *= 0.9;
+                    std::swap(app.iteration_count, shown_iterations);
+                    shown_iterations_current = true;
+                    histogram_current = false;
+                    recolour = true;
                 }
+                seconds_to_generate = frame_seconds;
+                window.setTitle("FPS: " + std::to_string(1.0 / seconds_to_generate));
+            } else if (job_is_frame) {
+                ++app.frames_cancelled;
+                // some of the screen is from a frame we didn't finish, so even the last frame's view needs computing again
+                if (frame_on_screen)
+                    have_frame = false;
             }
+            cache_stats = "\nTile cache: " + std::string(app.use_tile_cache ? "on" : "off") + ", " + std::to_string(app.tile_cache.size()) + " tiles, " +
+                          std::to_string(app.tile_cache.hits) + " hits, " + std::to_string(app.tile_cache.misses) + " misses, " +
+                          std::to_string(app.tiles_from_disk) + " from disk\tToggle using C" +
+                          "\nPrefetched: " + std::to_string(app.tiles_prefetched) + " tiles, hit rate " +
+                          std::to_string(100 * app.tile_cache.prefetch_hit_rate()) + "%";
+            redraw = true;
+        }
 
+        const long long now = current_nanoseconds();
+        const bool draw_due = redraw || now - last_draw >= 1000000000 / 60;
+        if (cycle_palette && draw_due)
+            palette_phase += PALETTE_CYCLE_SPEED * (now - last_draw) / 1e9f;
+        if (COLOURSCHEME == HISTOGRAM_COLOURSCHEME && shown_iterations_current && !histogram_current) {
+            Timer t(STAGE_HISTOGRAM);
+            histogram.build(shown_iterations.data(), (int)shown_iterations.size(), last_frame.max_iters);
+            histogram_current = true;
+        }
+        // While a frame is shown a tile at a time, its tiles keep changing the histogram, and the colours would change
+        // with every one of them. The colours catch up at the end of the frame instead.
+        const bool showing_tiles = job.running() && job_is_frame && progressive_frame;
+        if (palette.update(last_frame.max_iters, COLOURSCHEME, palette_phase, showing_tiles ? nullptr : &histogram))
+            recolour = true;
 
-            if (event.type == sf::Event::KeyPressed) {
-                if (event.key.code == sf::Keyboard::Key::Q) {
-                    app.scale *= 1.1;
-                } else if (event.key.code == sf::Keyboard::Key::A) {
-                    app.scale *= 0.9;
-                } else if (event.key.code == sf::Keyboard::Key::N) {
-                    MAX_ITERS += 32;
-                } else if (event.key.code == sf::Keyboard::Key::M) {
-                    MAX_ITERS = std::max(32, MAX_ITERS - 32);
-                }
+        // The worker is writing to pixels, so they have to wait
+        const bool worker_has_pixels = job.running() && job_is_frame && pixels_from_kernels;
+        if (recolour && !worker_has_pixels) {
+            // Colour. Only the iterations of the frame on screen are needed, so this doesn't wait for the worker, and
+            // switching or cycling palettes never recomputes anything.
+            if (shown_iterations_current) {
+                Timer t(STAGE_COLOUR);
+                colour_image(shown_iterations.data(), pixels.data(), app.width, app.height, palette);
+                upload = true;
+            } else if (have_frame) {
+                // the pixels came straight from the kernels, so the only way to recolour them is to compute them again
+                have_frame = false;
             }
-            vec2 mouse_in_world_after_zoom = app.screen_to_world(mouse);
-            auto diff = mouse_in_world_before_zoom - mouse_in_world_after_zoom;
-            app.offset += diff;
+            recolour = false;
+        }
+        if (upload && !worker_has_pixels) {
+            // Upload. This happens before the worker starts on a frame that writes to pixels.
+            Timer t(STAGE_UPLOAD);
+            tex.update((const sf::Uint8*)pixels.data());
+            upload = false;
+            redraw = true;
         }
 
-        window.clear();
-        {
-            Timer t("Loop Print");
-#ifdef USE_OMP
-#pragma omp parallel for
-#endif
-            for (int x = 0; x < WIDTH; ++x) {
-                for (int y = 0; y < HEIGHT; ++y) {
-                    int index_other = (y)*WIDTH + x;
-                    float a = 0.1;
-                    float n = (float)app.iteration_count[index_other];
-                    
-                    float r, g, b;
-                    if (COLOURSCHEME == 0){
-                        // from here: https://github.com/OneLoneCoder/Javidx9/blob/master/PixelGameEngine/SmallerProjects/OneLoneCoder_PGE_Mandelbrot.cpp#L543
-                        r = 0.5f * sin(a * n) + 0.5f;
-                        g = 0.5f * sin(a * n + 2.094f) + 0.5f;
-                        b = 0.5f * sin(a * n + 4.188f) + 0.5f;
-                    }else if (COLOURSCHEME == 1){
-                        r = n / MAX_ITERS;
-                        g = n / MAX_ITERS;
-                        b = n / MAX_ITERS;
-                    }
-                    for (int i = 0; i < size; ++i) {
-                        for (int j = 0; j < size; ++j) {
-                            int index = (y * size + i) * WIDTH_IMAGE + (x * size + j);
-                            pixels[index * 4 + 0] = (int)(r * 255);
-                            pixels[index * 4 + 1] = (int)(g * 255);
-                            pixels[index * 4 + 2] = (int)(b * 255);
-                            pixels[index * 4 + 3] = 255;
-                        }
+        if (!job.running()) {
+            // Compute: start on the next frame, if the view changed
+            View view = app.current_view();
+            unsigned frame_generation = app.generation;
+            if (!have_frame || view != last_frame) {
+                // Zooming happens around the mouse, so this is where the user is looking whether they are zooming or not
+                vec2 focus = mouse_position();
+                // cycling the palette and the histogram colours need the iterations
+                pixels_from_kernels = fused && app.can_fuse(view) && !cycle_palette && COLOURSCHEME != HISTOGRAM_COLOURSCHEME;
+                frame_palette.update(view.max_iters, COLOURSCHEME, palette_phase);
+                progressive_frame = app.publish_tiles && !view.use_tile_cache;
+                frame_on_screen = false;
+                // the histogram can only follow the tiles if they are counted the same way
+                if (progressive_frame && histogram.counts.size() != (size_t)view.max_iters + 1)
+                    histogram_current = false;
+                frame_view = view;
+                job_is_frame = true;
+                job.start([&, focus, frame_generation]() {
+                    trace_thread_name("worker");
+                    const long long start = current_nanoseconds();
+                    {
+                        Timer t(STAGE_COMPUTE);
+                        frame_done = pixels_from_kernels ? app.update_vec(frame_view, frame_generation, focus, &frame_palette, pixels.data())
+                                                         : app.update_vec(frame_view, frame_generation, focus);
                     }
+                    const long long end = current_nanoseconds();
+                    trace_event(frame_done ? "frame" : "cancelled frame", start, end, frame_generation);
+                    frame_seconds = (end - start) / 1e9;
+                });
+            } else if (view.use_tile_cache && !(prefetched && view == prefetch_view && mouse == prefetch_mouse)) {
+                // Nothing has changed since the last frame, so we use the time to compute tiles that we might need next
+                prefetch_view = view;
+                prefetch_mouse = mouse;
+                prefetched = true;
+                std::vector<TileKey> keys = app.prefetch_candidates(view, app.screen_to_world(mouse));
+                if (!keys.empty()) {
+                    job_is_frame = false;
+                    job.start([&app, keys, frame_generation]() {
+                        trace_thread_name("worker");
+                        Timer t(STAGE_PREFETCH);
+                        app.prefetch(keys, frame_generation);
+                    });
                 }
             }
         }
-        double seconds_to_generate;
-        {
-            Timer t("Update vec");
-            int s = current_microseconds();
-            app.update_vec();
-            int e = current_microseconds();
-            seconds_to_generate = (double)(e - s) / 1e6;
-        }
-        {
-            Timer t("Update tex");
-            tex.update(pixels.data());
+
+        // Draw, whenever there is something new to show and otherwise 60 times a second for the stats
+        if (!draw_due) {
+            sf::sleep(sf::milliseconds(1));
+            continue;
         }
-        window.draw(sprite);
-        int new_time = current_microseconds();
-        window.setTitle("FPS: " + std::to_string(1.0 / ((new_time - time_now) / (float)1e6)));
-        window.draw(text);
         // print stats
         text.setString("Scale: " + std::to_string(app.scale.x) + " log10 = " + std::to_string(log10(app.scale.x)) + "\tZoom in and out using Q and A" +
                        "\nOffset: " + std::to_string(app.offset.x) + "," + std::to_string(app.offset.y) + "\tPan using the mouse" +
                        "\nMaximum iterations: " + std::to_string(MAX_ITERS) + "\tIncrease / Decrease using N and M" +
-                       "\nTime taken to generate the iterations: " + std::to_string(seconds_to_generate)
-
+                       "\nTime taken to generate the iterations: " + std::to_string(seconds_to_generate) +
+                       "\nCancelled: " + std::to_string(app.frames_cancelled) + " frames, " + std::to_string(app.tiles_cancelled) + " tiles" +
+                       "\nColour scheme: " + std::to_string(COLOURSCHEME) + (COLOURSCHEME == HISTOGRAM_COLOURSCHEME ? " (histogram)" : "") + (cycle_palette ? ", cycling" : "") + "\tSwitch using K, cycle using P" +
+                       cache_stats +
+                       "\nTimings (print using S):" + stage_stats_text()
         );
+        Timer t(STAGE_DRAW);
+        window.clear();
+        window.draw(sprite);
+        window.draw(text);
         window.display();
-        time_now = current_microseconds();
+        redraw = false;
+        last_draw = now;
     }
 
+    // the worker writes to the locals of this loop, so it has to be done before they go away
+    app.cancel();
+    job.wait();
+    write_trace();
     return 0;
 }
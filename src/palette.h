@@ -0,0 +1,198 @@
+#pragma once
+// Turning iteration counts into colours. The colour only depends on the iteration count, so we work it out once
+// for every possible count, and colouring a pixel is then a lookup in that table.
+#ifdef USE_AVX
+    #include <immintrin.h>
+#endif
+#ifdef USE_OMP
+    #include <omp.h>
+#endif
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// How many colour schemes there are, see Palette::colour
+#define NUM_COLOURSCHEMES 3
+// The scheme that spreads the colours evenly over the pixels, see Histogram
+#define HISTOGRAM_COLOURSCHEME 2
+
+// A colour the way sf::Texture wants it in memory: the bytes R, G, B, A (on a little endian machine)
+inline uint32_t pack_rgba(int r, int g, int b, int a = 255) {
+    return (uint32_t)r | ((uint32_t)g << 8) | ((uint32_t)b << 16) | ((uint32_t)a << 24);
+}
+
+// How many pixels of a frame took each number of iterations. Colouring with its cumulative distribution instead of
+// dividing by the maximum number of iterations gives the same amount of every colour, however high that maximum is.
+struct Histogram {
+    // counts[n] is how many pixels took n iterations, for n in [0, max_iters]
+    std::vector<uint32_t> counts;
+    // goes up whenever counts change, so that a palette knows when to rebuild
+    unsigned version = 0;
+
+    // Counts all the iterations from scratch. Every thread counts its part into a histogram of its own, and these are
+    // then added up in parallel, so that the threads never write to the same counts.
+    void build(const int* iterations, int count, int max_iters) {
+        const int bins = max_iters + 1;
+#ifdef USE_OMP
+        const int threads = omp_get_max_threads();
+#else
+        const int threads = 1;
+#endif
+        // round up to a cache line, so that the threads' histograms don't share one
+        const int stride = (bins + 15) & ~15;
+        std::vector<uint32_t> local((size_t)threads * stride, 0);
+#ifdef USE_OMP
+#pragma omp parallel
+#endif
+        {
+#ifdef USE_OMP
+            uint32_t* mine = &local[(size_t)omp_get_thread_num() * stride];
+#pragma omp for schedule(static)
+#else
+            uint32_t* mine = &local[0];
+#endif
+            for (int i = 0; i < count; ++i)
+                ++mine[bin(iterations[i], max_iters)];
+        }
+        counts.assign(bins, 0);
+#ifdef USE_OMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int n = 0; n < bins; ++n) {
+            uint32_t total = 0;
+            for (int t = 0; t < threads; ++t)
+                total += local[(size_t)t * stride + n];
+            counts[n] = total;
+        }
+        ++version;
+    }
+
+    // For when only part of the frame changed: takes the pixels that were `before` out and puts the ones that are
+    // `after` in, without counting the rest of the frame again
+    void replace(const int* before, const int* after, int count) {
+        const int max_iters = (int)counts.size() - 1;
+        for (int i = 0; i < count; ++i) {
+            int b = bin(before[i], max_iters), a = bin(after[i], max_iters);
+            if (a != b) {
+                --counts[b];
+                ++counts[a];
+            }
+        }
+        ++version;
+    }
+
+    static int bin(int iterations, int max_iters) {
+        return iterations < 0 ? 0 : (iterations > max_iters ? max_iters : iterations);
+    }
+};
+
+struct Palette {
+    int max_iters = -1;
+    int scheme = -1;
+    // Shifts the colours along by this many iterations, which is how the palette gets cycled
+    float phase = 0;
+    // the version of the histogram the table was built from, for HISTOGRAM_COLOURSCHEME
+    unsigned histogram_version = 0;
+    // colours[n] is the colour of a pixel that took n iterations, for n in [0, max_iters]
+    std::vector<uint32_t> colours;
+
+    // Rebuilds the table if anything changed, and returns whether it did. HISTOGRAM_COLOURSCHEME needs the histogram
+    // of the frame, which has to be counted with the same max_iters.
+    bool update(int _max_iters, int _scheme, float _phase = 0, const Histogram* histogram = nullptr) {
+        const bool equalise = _scheme == HISTOGRAM_COLOURSCHEME && histogram && (int)histogram->counts.size() == _max_iters + 1;
+        if (_max_iters == max_iters && _scheme == scheme && _phase == phase && (!equalise || histogram->version == histogram_version))
+            return false;
+        max_iters = _max_iters;
+        scheme = _scheme;
+        phase = _phase;
+        colours.resize(max_iters + 1);
+        if (equalise) {
+            histogram_version = histogram->version;
+            equalised_colours(histogram->counts);
+            return true;
+        }
+        for (int n = 0; n <= max_iters; ++n)
+            colours[n] = colour(n, max_iters, scheme, phase);
+        return true;
+    }
+
+    // Each count gets the grey of the fraction of the escaped pixels that took at most that many iterations. The
+    // pixels that never escaped are white, like in the black and white scheme.
+    void equalised_colours(const std::vector<uint32_t>& counts) {
+        uint64_t escaped = 0;
+        for (int n = 0; n < max_iters; ++n)
+            escaped += counts[n];
+        uint64_t below = 0;
+        for (int n = 0; n < max_iters; ++n) {
+            below += counts[n];
+            float t = escaped == 0 ? 0 : std::min((float)below / escaped, 1.0f);
+            // cycling moves the greys along by a whole palette every max_iters + 1 iterations of phase. The highest
+            // counts are at t = 1, which would wrap around to black without any phase.
+            if (phase != 0)
+                t = fmodf(t + phase / (max_iters + 1), 1.0f);
+            colours[n] = pack_rgba((int)(t * 255), (int)(t * 255), (int)(t * 255));
+        }
+        colours[max_iters] = pack_rgba(255, 255, 255);
+    }
+
+    static uint32_t colour(int iterations, int max_iters, int scheme, float phase = 0) {
+        float a = 0.1;
+        float n = (float)iterations + phase;
+        float r, g, b;
+        if (scheme == 0) {
+            // from here: https://github.com/OneLoneCoder/Javidx9/blob/master/PixelGameEngine/SmallerProjects/OneLoneCoder_PGE_Mandelbrot.cpp#L543
+            r = 0.5f * sin(a * n) + 0.5f;
+            g = 0.5f * sin(a * n + 2.094f) + 0.5f;
+            b = 0.5f * sin(a * n + 4.188f) + 0.5f;
+        } else {
+            // black and white
+            n = fmodf(n, (float)(max_iters + 1));
+            r = n / max_iters;
+            g = n / max_iters;
+            b = n / max_iters;
+        }
+        return pack_rgba((int)(r * 255), (int)(g * 255), (int)(b * 255));
+    }
+};
+
+// Colours count pixels. Iteration counts outside of the table (e.g. from before MAX_ITERS went down) get the
+// colour of the closest count that is in it.
+inline void colour_iterations(const int* iterations, uint32_t* out, int count, const Palette& palette) {
+    const uint32_t* table = palette.colours.data();
+    const int top = (int)palette.colours.size() - 1;
+    int i = 0;
+#ifdef USE_AVX
+    // 8 pixels at a time, with the lookups done by a gather
+    const __m256i _zero = _mm256_setzero_si256();
+    const __m256i _top = _mm256_set1_epi32(top);
+    for (; i + 8 <= count; i += 8) {
+        __m256i _n = _mm256_loadu_si256((const __m256i*)(iterations + i));
+        _n = _mm256_min_epi32(_mm256_max_epi32(_n, _zero), _top);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_i32gather_epi32((const int*)table, _n, 4));
+    }
+#endif
+    for (; i < count; ++i) {
+        int n = iterations[i];
+        out[i] = table[n < 0 ? 0 : (n > top ? top : n)];
+    }
+}
+
+// colour_iterations for a whole image, a row per thread at a time
+inline void colour_image(const int* iterations, uint32_t* out, int width, int height, const Palette& palette) {
+#ifdef USE_OMP
+#pragma omp parallel for
+#endif
+    for (int y = 0; y < height; ++y)
+        colour_iterations(iterations + (size_t)y * width, out + (size_t)y * width, width, palette);
+}
+
+// Colours distance estimates (see get_distance_at) for pixels `pixel` world units apart: the set and everything within
+// a pixel of it is dark, fading to white a pixel away, so that filaments thinner than a pixel still show up.
+inline void colour_distances(const float* distances, uint32_t* out, int count, double pixel) {
+    for (int i = 0; i < count; ++i) {
+        const float t = std::min(1.0f, (float)(distances[i] / pixel));
+        const int grey = (int)(255 * std::sqrt(t));
+        out[i] = pack_rgba(grey, grey, grey);
+    }
+}
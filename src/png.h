@@ -0,0 +1,158 @@
+#pragma once
+// A PNG encoder that compresses in parallel, and that takes the image a few rows at a time so that posters can be
+// streamed to disk.
+//
+// The image data of a PNG is a single zlib stream, but a deflate stream is just a list of blocks. Every strip of rows
+// is compressed on its own as raw deflate blocks that end with a sync flush (which ends on a byte boundary and isn't
+// the last block), so the strips can be compressed by different threads and glued together. The adler32 checksums of
+// the strips are combined into the one of the whole stream at the end.
+#ifdef USE_OMP
+    #include <omp.h>
+#endif
+#include <zlib.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// How many rows every thread compresses at a time
+#define PNG_STRIP_ROWS 32
+
+struct PngWriter {
+    FILE* file = nullptr;
+    int width = 0, height = 0;
+    int rows_written = 0;
+    uLong adler = adler32(0, Z_NULL, 0);
+    bool ok = false;
+
+    // Starts a width x height RGB image at path. Check ok afterwards.
+    PngWriter(const std::string& path, int _width, int _height) : width(_width), height(_height) {
+        file = fopen(path.c_str(), "wb");
+        if (!file)
+            return;
+        ok = fwrite("\x89PNG\r\n\x1a\n", 1, 8, file) == 8;
+        uint8_t header[13];
+        put_u32(header, width);
+        put_u32(header + 4, height);
+        header[8] = 8;  // bits per channel
+        header[9] = 2;  // RGB
+        header[10] = 0; // deflate
+        header[11] = 0; // adaptive filtering
+        header[12] = 0; // not interlaced
+        chunk("IHDR", header, sizeof(header));
+        // the zlib header: deflate with a 32K window, default compression
+        const uint8_t zlib_header[2] = {0x78, 0x9c};
+        chunk("IDAT", zlib_header, sizeof(zlib_header));
+    }
+
+    PngWriter(const PngWriter&) = delete;
+    PngWriter& operator=(const PngWriter&) = delete;
+
+    ~PngWriter() {
+        if (file)
+            fclose(file);
+    }
+
+    // Adds the next rows of the image, given as colours like the ones in Palette (R, G, B, A bytes)
+    void write_rows(const uint32_t* colours, int rows) {
+        const int strips = (rows + PNG_STRIP_ROWS - 1) / PNG_STRIP_ROWS;
+        std::vector<std::vector<uint8_t>> compressed(strips);
+        std::vector<uLong> adlers(strips);
+        std::vector<uLong> lengths(strips);
+        bool compressed_ok = true;
+#ifdef USE_OMP
+#pragma omp parallel for schedule(dynamic) reduction(&&:compressed_ok)
+#endif
+        for (int s = 0; s < strips; ++s) {
+            const int y0 = s * PNG_STRIP_ROWS;
+            const int strip_rows = rows - y0 < PNG_STRIP_ROWS ? rows - y0 : PNG_STRIP_ROWS;
+            std::vector<uint8_t> raw = filter_rows(colours + (size_t)y0 * width, strip_rows);
+            lengths[s] = raw.size();
+            adlers[s] = adler32(adler32(0, Z_NULL, 0), raw.data(), raw.size());
+            compressed_ok = deflate_strip(raw, Z_SYNC_FLUSH, compressed[s]) && compressed_ok;
+        }
+        ok = ok && compressed_ok;
+        for (int s = 0; s < strips; ++s) {
+            adler = adler32_combine(adler, adlers[s], lengths[s]);
+            chunk("IDAT", compressed[s].data(), compressed[s].size());
+        }
+        rows_written += rows;
+    }
+
+    // Ends the image, and returns whether all of it made it to the file
+    bool close() {
+        if (!file)
+            return false;
+        // an empty last block, and then the checksum of everything
+        std::vector<uint8_t> last;
+        ok = ok && deflate_strip(std::vector<uint8_t>(), Z_FINISH, last);
+        uint8_t checksum[4];
+        put_u32(checksum, (uint32_t)adler);
+        last.insert(last.end(), checksum, checksum + 4);
+        chunk("IDAT", last.data(), last.size());
+        chunk("IEND", nullptr, 0);
+        ok = ok && rows_written == height;
+        ok = fclose(file) == 0 && ok;
+        file = nullptr;
+        return ok;
+    }
+
+private:
+    static void put_u32(uint8_t* out, uint32_t v) {
+        out[0] = v >> 24;
+        out[1] = v >> 16;
+        out[2] = v >> 8;
+        out[3] = v;
+    }
+
+    void chunk(const char* type, const uint8_t* data, size_t length) {
+        uint8_t header[8];
+        put_u32(header, (uint32_t)length);
+        memcpy(header + 4, type, 4);
+        uLong crc = crc32(0, (const Bytef*)type, 4);
+        if (length > 0)
+            crc = crc32(crc, data, (uInt)length);
+        uint8_t footer[4];
+        put_u32(footer, (uint32_t)crc);
+        ok = ok && fwrite(header, 1, 8, file) == 8 && (length == 0 || fwrite(data, 1, length, file) == length) &&
+             fwrite(footer, 1, 4, file) == 4;
+    }
+
+    // The rows as PNG wants them before compression: every row is a filter type and then its RGB bytes. We use the
+    // Sub filter (every byte minus the one a pixel to the left), which only looks inside the row, so that strips
+    // don't depend on each other. Fractals have large areas of the same colour, which this turns into zeros.
+    std::vector<uint8_t> filter_rows(const uint32_t* colours, int rows) const {
+        const size_t row_bytes = 1 + (size_t)width * 3;
+        std::vector<uint8_t> raw(row_bytes * rows);
+        for (int y = 0; y < rows; ++y) {
+            uint8_t* out = &raw[y * row_bytes];
+            const uint32_t* row = colours + (size_t)y * width;
+            out[0] = 1;
+            uint32_t previous = 0;
+            for (int x = 0; x < width; ++x) {
+                out[1 + 3 * x] = (uint8_t)(row[x] - previous);
+                out[2 + 3 * x] = (uint8_t)((row[x] >> 8) - (previous >> 8));
+                out[3 + 3 * x] = (uint8_t)((row[x] >> 16) - (previous >> 16));
+                previous = row[x];
+            }
+        }
+        return raw;
+    }
+
+    // Compresses raw into raw deflate blocks (no zlib header or checksum), ending with flush
+    static bool deflate_strip(const std::vector<uint8_t>& raw, int flush, std::vector<uint8_t>& out) {
+        z_stream stream = {};
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        out.resize(deflateBound(&stream, raw.size()) + 16);
+        stream.next_in = (Bytef*)raw.data();
+        stream.avail_in = (uInt)raw.size();
+        stream.next_out = out.data();
+        stream.avail_out = (uInt)out.size();
+        int result = deflate(&stream, flush);
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+        return stream.avail_in == 0 && (result == Z_OK || result == Z_STREAM_END);
+    }
+};
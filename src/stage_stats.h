@@ -0,0 +1,139 @@
+#pragma once
+// How long the stages of the program take, always measured. A Timer adds the time between its construction and its
+// destruction to the histogram of its stage, which any thread can do at the same time without locks: every histogram
+// is just atomic counters. The stats text in the window shows the min, median and 99th percentile of every stage, and
+// S prints them all. With tracing on, every Timer is also an event of the trace.
+//
+// The histograms have 8 buckets for every doubling of the time, so a percentile is within about 6% of the real one,
+// from nanoseconds up to about half an hour in 312 buckets.
+#include <atomic>
+#include <climits>
+#include <cstdio>
+#include <string>
+#include "trace.h"
+
+enum Stage {
+    STAGE_EVENTS,
+    STAGE_COMPUTE,
+    STAGE_PREFETCH,
+    STAGE_HISTOGRAM,
+    STAGE_COLOUR,
+    STAGE_UPLOAD,
+    STAGE_DRAW,
+    STAGE_ANTIALIAS,
+    STAGE_ENCODE,
+    NUM_STAGES
+};
+
+static const char* const STAGE_NAMES[NUM_STAGES] = {
+    "events", "compute", "prefetch", "histogram", "colour", "upload", "draw", "antialias", "encode"};
+
+#define STAGE_BUCKETS_PER_DOUBLING 8
+#define STAGE_BUCKETS 312
+
+struct StageStats {
+    std::atomic<long long> count{0}, min{LLONG_MAX}, max{0};
+    std::atomic<unsigned> buckets[STAGE_BUCKETS];
+
+    StageStats() {
+        for (std::atomic<unsigned>& b : buckets)
+            b.store(0, std::memory_order_relaxed);
+    }
+
+    void add(long long nanoseconds) {
+        nanoseconds = nanoseconds > 0 ? nanoseconds : 0;
+        buckets[bucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        long long seen = min.load(std::memory_order_relaxed);
+        while (nanoseconds < seen && !min.compare_exchange_weak(seen, nanoseconds, std::memory_order_relaxed)) {}
+        seen = max.load(std::memory_order_relaxed);
+        while (nanoseconds > seen && !max.compare_exchange_weak(seen, nanoseconds, std::memory_order_relaxed)) {}
+    }
+
+    // Times below 8 ns get a bucket each, and from there on every doubling is split into 8 equal buckets, picked by the
+    // 3 bits after the highest one
+    static int bucket(long long nanoseconds) {
+        if (nanoseconds < STAGE_BUCKETS_PER_DOUBLING)
+            return (int)nanoseconds;
+        const int high_bit = 63 - __builtin_clzll((unsigned long long)nanoseconds);
+        const int b = (high_bit - 2) * STAGE_BUCKETS_PER_DOUBLING + (int)((nanoseconds >> (high_bit - 3)) & 7);
+        return b < STAGE_BUCKETS ? b : STAGE_BUCKETS - 1;
+    }
+
+    // The smallest time in bucket b, and how wide it is
+    static long long bucket_start(int b, long long& width) {
+        if (b < STAGE_BUCKETS_PER_DOUBLING) {
+            width = 1;
+            return b;
+        }
+        const int high_bit = b / STAGE_BUCKETS_PER_DOUBLING + 2;
+        width = 1LL << (high_bit - 3);
+        return (long long)(STAGE_BUCKETS_PER_DOUBLING + b % STAGE_BUCKETS_PER_DOUBLING) << (high_bit - 3);
+    }
+
+    // The time that p percent of the times were at most, the middle of its bucket, or 0 if there are none
+    long long percentile(double p) const {
+        const long long n = count.load(std::memory_order_relaxed);
+        if (n == 0)
+            return 0;
+        long long wanted = (long long)(p / 100 * n + 0.5), seen = 0;
+        wanted = wanted < 1 ? 1 : wanted;
+        for (int b = 0; b < STAGE_BUCKETS; ++b) {
+            seen += buckets[b].load(std::memory_order_relaxed);
+            if (seen >= wanted) {
+                long long width;
+                const long long middle = bucket_start(b, width) + width / 2;
+                const long long lo = min.load(std::memory_order_relaxed), hi = max.load(std::memory_order_relaxed);
+                return middle < lo ? lo : middle > hi ? hi : middle;
+            }
+        }
+        return max.load(std::memory_order_relaxed);
+    }
+
+    // e.g. "min 1.20 ms, median 1.52 ms, p99 3.10 ms, 120 times"
+    std::string summary() const {
+        char line[128];
+        const long long n = count.load(std::memory_order_relaxed);
+        snprintf(line, sizeof(line), "min %.2f ms, median %.2f ms, p99 %.2f ms, %lld times",
+                 n ? min.load(std::memory_order_relaxed) / 1e6 : 0.0, percentile(50) / 1e6, percentile(99) / 1e6, n);
+        return line;
+    }
+};
+
+static StageStats stage_stats[NUM_STAGES];
+
+// Adds the time it is alive to its stage
+struct Timer {
+    Stage stage;
+    long long start;
+
+    explicit Timer(Stage _stage) : stage(_stage), start(current_nanoseconds()) {}
+
+    ~Timer() {
+        const long long end = current_nanoseconds();
+        stage_stats[stage].add(end - start);
+        trace_event(STAGE_NAMES[stage], start, end);
+    }
+};
+
+// A line for every stage that has happened, for the stats text
+static std::string stage_stats_text() {
+    std::string text;
+    for (int s = 0; s < NUM_STAGES; ++s) {
+        if (stage_stats[s].count.load(std::memory_order_relaxed) > 0)
+            text += "\n" + std::string(STAGE_NAMES[s]) + ": " + stage_stats[s].summary();
+    }
+    return text;
+}
+
+static void print_stage_stats(FILE* out) {
+    fprintf(out, "%-10s %10s %10s %10s %10s %10s\n", "stage", "count", "min ms", "median ms", "p99 ms", "max ms");
+    for (int s = 0; s < NUM_STAGES; ++s) {
+        const StageStats& stats = stage_stats[s];
+        const long long n = stats.count.load(std::memory_order_relaxed);
+        if (n == 0)
+            continue;
+        fprintf(out, "%-10s %10lld %10.3f %10.3f %10.3f %10.3f\n", STAGE_NAMES[s], n, stats.min.load(std::memory_order_relaxed) / 1e6,
+                stats.percentile(50) / 1e6, stats.percentile(99) / 1e6, stats.max.load(std::memory_order_relaxed) / 1e6);
+    }
+}
@@ -0,0 +1,172 @@
+#pragma once
+// A tile store on disk, so that computed tiles survive restarts.
+//
+// It is a single file that gets memory mapped:
+//   header | index of `capacity` slots | data of `capacity` tiles
+// A tile lives in one of the MAX_PROBES slots after the hash of its key, and its iterations are in the data
+// section at the same position as its slot. When all of those slots are taken, the first one is overwritten.
+// The file is created at its full size, which most file systems store sparsely until tiles are written.
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include "tiles.h"
+
+// How many tiles fit in a new store, 16384 64x64 tiles is 256MB
+#define TILE_STORE_TILES 16384
+
+struct TileStore {
+    static const int MAX_PROBES = 16;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t tile_size;
+        uint32_t capacity;
+        uint32_t unused;
+    };
+
+    struct Slot {
+        int32_t level;
+        int32_t max_iters;
+        int64_t x, y;
+        int32_t which_set;
+        // 0 when the slot is empty or being written to
+        uint32_t used;
+    };
+
+    int tile_size;
+    uint32_t capacity = 0;
+    int fd = -1;
+    size_t file_size = 0;
+    char* file = nullptr;
+    Slot* slots = nullptr;
+    int32_t* data = nullptr;
+
+    // Opens the store at path, creating it if needed. Check is_open() afterwards.
+    TileStore(const char* path, int _tile_size) : tile_size(_tile_size) {
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            perror(path);
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            perror(path);
+            close_file();
+            return;
+        }
+        Header header;
+        if (st.st_size == 0) {
+            // a new store
+            memcpy(header.magic, "MBTILES1", 8);
+            header.version = 1;
+            header.tile_size = tile_size;
+            header.capacity = TILE_STORE_TILES;
+            header.unused = 0;
+            if (ftruncate(fd, bytes_needed(header.capacity)) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+                perror(path);
+                close_file();
+                return;
+            }
+        } else if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, "MBTILES1", 8) != 0 ||
+                   header.version != 1 || (int)header.tile_size != tile_size || header.capacity == 0 ||
+                   (size_t)st.st_size != bytes_needed(header.capacity)) {
+            fprintf(stderr, "%s is not a tile store for %dx%d tiles, not using it\n", path, tile_size, tile_size);
+            close_file();
+            return;
+        }
+        capacity = header.capacity;
+        file_size = bytes_needed(capacity);
+        void* mapped = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            perror(path);
+            close_file();
+            return;
+        }
+        file = (char*)mapped;
+        slots = (Slot*)(file + sizeof(Header));
+        data = (int32_t*)(file + sizeof(Header) + capacity * sizeof(Slot));
+    }
+
+    TileStore(const TileStore&) = delete;
+    TileStore& operator=(const TileStore&) = delete;
+
+    ~TileStore() {
+        if (file)
+            munmap(file, file_size);
+        close_file();
+    }
+
+    bool is_open() const {
+        return file != nullptr;
+    }
+
+    size_t tile_ints() const {
+        return (size_t)tile_size * tile_size;
+    }
+
+    size_t bytes_needed(uint32_t tiles) const {
+        return sizeof(Header) + tiles * (sizeof(Slot) + tile_ints() * sizeof(int32_t));
+    }
+
+    bool contains(const TileKey& key) const {
+        return find_slot(key) >= 0;
+    }
+
+    // Copies the tile into out (tile_size * tile_size ints) and returns true if it is in the store
+    bool read(const TileKey& key, int* out) const {
+        long slot = find_slot(key);
+        if (slot < 0)
+            return false;
+        memcpy(out, data + slot * tile_ints(), tile_ints() * sizeof(int32_t));
+        return true;
+    }
+
+    void write(const TileKey& key, const int* tile) {
+        size_t home = TileKeyHash()(key) % capacity;
+        size_t slot = home;
+        for (int probe = 0; probe < MAX_PROBES; ++probe) {
+            size_t candidate = (home + probe) % capacity;
+            if (!slots[candidate].used || matches(slots[candidate], key)) {
+                slot = candidate;
+                break;
+            }
+        }
+        // mark it as empty while we write, so that a crash halfway through doesn't leave a broken tile behind
+        slots[slot].used = 0;
+        memcpy(data + slot * tile_ints(), tile, tile_ints() * sizeof(int32_t));
+        slots[slot].level = key.level;
+        slots[slot].max_iters = key.max_iters;
+        slots[slot].x = key.x;
+        slots[slot].y = key.y;
+        slots[slot].which_set = key.which_set;
+        slots[slot].used = 1;
+    }
+
+private:
+    // The slot the tile is in, or -1
+    long find_slot(const TileKey& key) const {
+        size_t home = TileKeyHash()(key) % capacity;
+        for (int probe = 0; probe < MAX_PROBES; ++probe) {
+            size_t slot = (home + probe) % capacity;
+            if (slots[slot].used && matches(slots[slot], key))
+                return (long)slot;
+        }
+        return -1;
+    }
+
+    static bool matches(const Slot& slot, const TileKey& key) {
+        return slot.level == key.level && slot.max_iters == key.max_iters && slot.x == key.x && slot.y == key.y &&
+               slot.which_set == key.which_set;
+    }
+
+    void close_file() {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+};
@@ -0,0 +1,143 @@
+#pragma once
+// The complex plane split up into a quadtree of tiles, and an LRU cache of the iterations of those tiles.
+//
+// At level L a tile pixel is 2^-L world units wide, so tile (x, y) has its top left pixel at world position
+// (x, y) * TILE_SIZE * 2^-L. Going one level down splits every tile into 4, which means the same tile comes back
+// whenever we pan or zoom back to somewhere we have been before.
+#include <cmath>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "kernels.h"
+
+// How many tiles to keep in memory, each one is TILE_SIZE * TILE_SIZE ints (16KB for 64x64 tiles)
+#define TILE_CACHE_TILES 4096
+
+struct TileKey {
+    int level;
+    int64_t x, y;
+    int max_iters;
+    int which_set;
+
+    bool operator==(const TileKey& other) const {
+        return level == other.level && x == other.x && y == other.y && max_iters == other.max_iters && which_set == other.which_set;
+    }
+};
+
+struct TileKeyHash {
+    size_t operator()(const TileKey& key) const {
+        // splitmix64 of each field in turn. This doesn't use std::hash so that it is the same everywhere, which the
+        // tile store on disk relies on.
+        uint64_t h = 0;
+        auto combine = [&h](uint64_t v) {
+            h += v + 0x9e3779b97f4a7c15ULL;
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+            h = h ^ (h >> 31);
+        };
+        combine((uint64_t)key.level);
+        combine((uint64_t)key.x);
+        combine((uint64_t)key.y);
+        combine((uint64_t)key.max_iters);
+        combine((uint64_t)key.which_set);
+        return (size_t)h;
+    }
+};
+
+// The world distance between two pixels of a tile at this level
+inline double tile_pixel_size(int level) {
+    return std::ldexp(1.0, -level);
+}
+
+// The level whose pixels are closest in size to the screen pixels at this scale (pixels per world unit)
+inline int tile_level_for_scale(double scale) {
+    return (int)std::lround(std::log2(scale));
+}
+
+// The coarsest level whose pixels are no bigger than the screen pixels at this scale, so that sampling from it never
+// loses detail. Scales that are a power of 2 (give or take rounding) get their own level.
+inline int finer_tile_level_for_scale(double scale) {
+    return (int)std::ceil(std::log2(scale) - 1e-9);
+}
+
+// floor(a / b) for b > 0, the tile that global pixel a is in
+inline int64_t floor_div(int64_t a, int64_t b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+inline Block tile_block(const TileKey& key, int tile_size) {
+    double pixel = tile_pixel_size(key.level);
+    return {key.x * tile_size * pixel, key.y * tile_size * pixel, pixel, pixel, tile_size, tile_size};
+}
+
+typedef std::shared_ptr<const std::vector<int>> TileData;
+
+// A least recently used cache of tiles. Tiles are handed out as shared pointers, so one that gets evicted while a
+// frame is still using it stays alive until that frame is done with it.
+struct TileCache {
+    struct Entry {
+        TileData data;
+        // computed ahead of time and not looked at by a frame yet
+        bool prefetched;
+    };
+    typedef std::list<std::pair<TileKey, Entry>> List;
+
+    size_t capacity;
+    // most recently used at the front
+    List entries;
+    std::unordered_map<TileKey, List::iterator, TileKeyHash> index;
+    long long hits = 0, misses = 0;
+    // hits on tiles that were only there because they were prefetched
+    long long prefetch_hits = 0;
+
+    explicit TileCache(size_t _capacity) : capacity(_capacity) {}
+
+    // Returns the tile, or null if it is not in the cache
+    TileData find(const TileKey& key) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            ++misses;
+            return TileData();
+        }
+        ++hits;
+        Entry& entry = it->second->second;
+        if (entry.prefetched) {
+            ++prefetch_hits;
+            entry.prefetched = false;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        return entry.data;
+    }
+
+    // Whether the tile is there, without counting it as a hit or miss or using it
+    bool contains(const TileKey& key) const {
+        return index.count(key) > 0;
+    }
+
+    void insert(const TileKey& key, TileData data, bool prefetched = false) {
+        auto it = index.find(key);
+        if (it != index.end()) {
+            it->second->second = {data, prefetched};
+            entries.splice(entries.begin(), entries, it->second);
+            return;
+        }
+        entries.emplace_front(key, Entry{data, prefetched});
+        index[key] = entries.begin();
+        while (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    // How many of the tiles that frames needed and weren't cached beforehand were there because of prefetching
+    double prefetch_hit_rate() const {
+        return prefetch_hits + misses == 0 ? 0 : (double)prefetch_hits / (prefetch_hits + misses);
+    }
+};
@@ -0,0 +1,188 @@
+#pragma once
+// A recorder of what every thread was doing when, for finding out why a frame was slow, e.g. which tiles took longest
+// or which threads sat idle. It is off until Trace::enable, and then every thread writes its events (tiles, frames,
+// the stages of stage_stats.h) into its own ring buffer of the last TRACE_EVENTS_PER_THREAD events. Writing is a couple
+// of stores and an atomic increment, without locks. write_json saves all of them in the Chrome trace format, which
+// chrome://tracing and https://ui.perfetto.dev show as a timeline with a row per thread.
+//
+// Threads come and go (every job of the window has its own), so a buffer goes back to the trace when its thread ends
+// and the next new thread takes it over. A row of the timeline is a buffer rather than a thread.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define TRACE_EVENTS_PER_THREAD (1 << 16)
+
+// Nanoseconds from some fixed point in the past, on a clock that is never set back
+inline long long current_nanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct TraceEvent {
+    // string literals, so that recording doesn't copy anything. kernel is set for tiles: what computed them.
+    const char* name;
+    const char* kernel;
+    long long start, end;
+    // the generation of the frame it belongs to, or 0
+    unsigned frame;
+    // for tiles: the pixels they cover (or their position in the pyramid for the tile cache), and the sum of the
+    // iterations of those pixels, or -1 if they weren't counted
+    long long x, y, width, height, iterations;
+};
+
+// The events of one thread at a time. Only that thread writes, and anyone can read.
+struct TraceBuffer {
+    std::vector<TraceEvent> events;
+    // how many events were ever written, the last TRACE_EVENTS_PER_THREAD of them are in events
+    std::atomic<unsigned long long> written{0};
+    int id;
+    std::string name;
+
+    TraceBuffer(int _id) : events(TRACE_EVENTS_PER_THREAD), id(_id), name("thread " + std::to_string(_id)) {}
+
+    void push(const TraceEvent& event) {
+        const unsigned long long n = written.load(std::memory_order_relaxed);
+        events[n % TRACE_EVENTS_PER_THREAD] = event;
+        written.store(n + 1, std::memory_order_release);
+    }
+
+    // A copy of the events that are there, oldest first. The thread can keep writing meanwhile, so the ones it may
+    // have overwritten while they were copied are left out.
+    std::vector<TraceEvent> snapshot() const {
+        const unsigned long long end = written.load(std::memory_order_acquire);
+        const unsigned long long begin = end > TRACE_EVENTS_PER_THREAD ? end - TRACE_EVENTS_PER_THREAD : 0;
+        std::vector<TraceEvent> copy;
+        copy.reserve(end - begin);
+        for (unsigned long long i = begin; i < end; ++i)
+            copy.push_back(events[i % TRACE_EVENTS_PER_THREAD]);
+        // writing event n overwrites event n - TRACE_EVENTS_PER_THREAD, and event `after` may be half written
+        const unsigned long long after = written.load(std::memory_order_acquire);
+        if (after + 1 > begin + TRACE_EVENTS_PER_THREAD)
+            copy.erase(copy.begin(), copy.begin() + std::min<size_t>(copy.size(), after + 1 - begin - TRACE_EVENTS_PER_THREAD));
+        return copy;
+    }
+};
+
+struct Trace {
+    std::atomic<bool> enabled{false};
+    // where the timeline starts
+    long long origin = 0;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+    // the buffers whose threads have ended
+    std::vector<TraceBuffer*> unused;
+
+    void enable() {
+        origin = current_nanoseconds();
+        enabled = true;
+    }
+
+    bool is_enabled() const {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    TraceBuffer* take_buffer() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!unused.empty()) {
+            TraceBuffer* buffer = unused.back();
+            unused.pop_back();
+            buffer->name = "thread " + std::to_string(buffer->id);
+            return buffer;
+        }
+        buffers.emplace_back(new TraceBuffer((int)buffers.size()));
+        return buffers.back().get();
+    }
+
+    void give_back(TraceBuffer* buffer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        unused.push_back(buffer);
+    }
+
+    // Writes every buffer as a Chrome trace. Returns whether it worked.
+    bool write_json(const std::string& path) {
+        FILE* file = fopen(path.c_str(), "w");
+        if (!file)
+            return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        bool ok = fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n") > 0;
+        bool first = true;
+        for (const std::unique_ptr<TraceBuffer>& buffer : buffers) {
+            ok = ok && fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                               first ? "" : ",\n", buffer->id, buffer->name.c_str()) > 0;
+            first = false;
+            for (const TraceEvent& e : buffer->snapshot()) {
+                ok = ok && fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {",
+                                   e.name, e.kernel ? "tile" : e.frame ? "frame" : "stage", buffer->id, (e.start - origin) / 1e3,
+                                   (e.end - e.start) / 1e3) > 0;
+                const char* separator = "";
+                if (e.frame) {
+                    ok = ok && fprintf(file, "\"frame\": %u", e.frame) > 0;
+                    separator = ", ";
+                }
+                if (e.kernel) {
+                    ok = ok && fprintf(file, "%s\"kernel\": \"%s\", \"x\": %lld, \"y\": %lld, \"width\": %lld, \"height\": %lld",
+                                       separator, e.kernel, e.x, e.y, e.width, e.height) > 0;
+                    if (e.iterations >= 0)
+                        ok = ok && fprintf(file, ", \"iterations\": %lld", e.iterations) > 0;
+                }
+                ok = ok && fprintf(file, "}}") > 0;
+            }
+        }
+        ok = ok && fprintf(file, "\n]}\n") > 0;
+        return fclose(file) == 0 && ok;
+    }
+};
+
+static Trace trace;
+
+// The buffer of the thread it belongs to, which goes back to the trace when the thread ends
+struct ThreadTraceBuffer {
+    TraceBuffer* buffer = nullptr;
+
+    ~ThreadTraceBuffer() {
+        if (buffer)
+            trace.give_back(buffer);
+    }
+};
+
+inline TraceBuffer* thread_trace_buffer() {
+    static thread_local ThreadTraceBuffer local;
+    if (!local.buffer)
+        local.buffer = trace.take_buffer();
+    return local.buffer;
+}
+
+// Records an event on the calling thread, if tracing is on
+inline void trace_event(const TraceEvent& event) {
+    if (trace.is_enabled())
+        thread_trace_buffer()->push(event);
+}
+
+inline void trace_event(const char* name, long long start, long long end, unsigned frame = 0) {
+    if (trace.is_enabled())
+        thread_trace_buffer()->push({name, nullptr, start, end, frame, 0, 0, 0, 0, -1});
+}
+
+// Names the row of the calling thread's buffer in the timeline, e.g. "main"
+inline void trace_thread_name(const char* name) {
+    if (!trace.is_enabled())
+        return;
+    TraceBuffer* buffer = thread_trace_buffer();
+    std::lock_guard<std::mutex> lock(trace.mutex);
+    buffer->name = name;
+}
+
+// The sum of the iterations of w x h pixels, for the events of tiles
+inline long long sum_iterations(const int* iterations, int w, int h, int stride) {
+    long long sum = 0;
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x)
+            sum += iterations[(size_t)y * stride + x];
+    }
+    return sum;
+}
@@ -0,0 +1,47 @@
+#pragma once
+// Writes frames to a YUV4MPEG2 (.y4m) stream, the uncompressed video format that ffmpeg, x264 and most players read,
+// e.g. `ffmpeg -i zoom.y4m zoom.mp4`. The frames are 4:4:4, so no colour is lost to subsampling.
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct Y4mWriter {
+    FILE* file = nullptr;
+    int width, height;
+    bool ok = false;
+
+    Y4mWriter(const std::string& path, int _width, int _height, int fps) : width(_width), height(_height) {
+        file = fopen(path.c_str(), "wb");
+        ok = file && fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, fps) > 0;
+    }
+
+    Y4mWriter(const Y4mWriter&) = delete;
+    Y4mWriter& operator=(const Y4mWriter&) = delete;
+
+    ~Y4mWriter() {
+        if (file)
+            fclose(file);
+    }
+
+    // Adds a frame, given as colours like the ones in Palette (R, G, B, A bytes)
+    void write_frame(const uint32_t* colours) {
+        const size_t count = (size_t)width * height;
+        // the Y, U and V planes one after the other, using the BT.601 studio range that video tools expect
+        std::vector<uint8_t> planes(count * 3);
+        for (size_t i = 0; i < count; ++i) {
+            const float r = colours[i] & 0xff, g = (colours[i] >> 8) & 0xff, b = (colours[i] >> 16) & 0xff;
+            planes[i] = (uint8_t)(16.5f + (65.481f * r + 128.553f * g + 24.966f * b) / 255);
+            planes[count + i] = (uint8_t)(128.5f + (-37.797f * r - 74.203f * g + 112.0f * b) / 255);
+            planes[2 * count + i] = (uint8_t)(128.5f + (112.0f * r - 93.786f * g - 18.214f * b) / 255);
+        }
+        ok = ok && fputs("FRAME\n", file) >= 0 && fwrite(planes.data(), 1, planes.size(), file) == planes.size();
+    }
+
+    // Returns whether every frame made it to the file
+    bool close() {
+        ok = file && fclose(file) == 0 && ok;
+        file = nullptr;
+        return ok;
+    }
+};